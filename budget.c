@@ -0,0 +1,54 @@
+/*
+    Accounting for the memory the server holds on behalf of clients, against one global budget.
+*/
+
+#include "budget.h"
+
+static long limit = BUDGET_DEFAULT_BYTES;
+static long used[BUDGET_CLASSES];
+static long total;
+
+static const char *class_names[] = {"outbound", "connections", "logins", "history"};
+
+void budget_set_limit(long nbytes)
+{
+    limit = nbytes;
+}
+
+long budget_limit()
+{
+    return limit;
+}
+
+// Record memory taken. Charges always succeed; callers check budget_exceeded() to decide what to shed
+void budget_charge(enum budget_class class, long nbytes)
+{
+    used[class] += nbytes;
+    total += nbytes;
+}
+
+void budget_release(enum budget_class class, long nbytes)
+{
+    used[class] -= nbytes;
+    total -= nbytes;
+}
+
+long budget_used(enum budget_class class)
+{
+    return used[class];
+}
+
+long budget_total()
+{
+    return total;
+}
+
+int budget_exceeded()
+{
+    return total > limit;
+}
+
+const char *budget_class_name(enum budget_class class)
+{
+    return class_names[class];
+}
@@ -0,0 +1,29 @@
+/*
+    Accounting for the memory the server holds on behalf of clients, against one global budget.
+    Everything that grows with the number or behaviour of clients is charged here, so the server can shed load before
+    the process grows past the budget rather than after. Only the main thread charges or releases.
+*/
+
+#pragma once
+
+#define BUDGET_DEFAULT_BYTES (8L * 1024 * 1024)
+
+enum budget_class
+{
+    BUDGET_OUTBOUND,    // Frames waiting to be sent, counted once however many queues share them
+    BUDGET_CONNECTIONS, // Per-client state: the user record and its outbound queue
+    BUDGET_LOGINS,      // Login threads, stack included
+    BUDGET_HISTORY,     // Room history and the mailboxes of users who are away
+    BUDGET_CLASSES
+};
+
+void budget_set_limit(long nbytes);
+long budget_limit();
+
+void budget_charge(enum budget_class class, long nbytes);
+void budget_release(enum budget_class class, long nbytes);
+
+long budget_used(enum budget_class class);
+long budget_total();
+int budget_exceeded();
+const char *budget_class_name(enum budget_class class);
@@ -0,0 +1,399 @@
+/*
+    Headless chatroom client.
+*/
+
+#define _GNU_SOURCE
+
+#include "chat_client.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define RECVBUFSIZE 16384
+#define MAX_ANSWER_LENGTH 256
+
+struct chat_client
+{
+    int sockfd;
+    char peer[INET6_ADDRSTRLEN];
+    char username[MAX_ANSWER_LENGTH]; // As the server confirmed it, which can differ from what was typed
+    char notice[CHAT_CLIENT_MAX_LINE]; // Last thing the server said during login (join message or why it refused us)
+
+    // Bytes received but not yet consumed. During login these are NUL-terminated handshake messages
+    char in[RECVBUFSIZE];
+    int in_len;
+
+    // Partial line of chat, waiting for its terminating LF. One spare byte to terminate a line that filled it
+    char line[CHAT_CLIENT_MAX_LINE + 1];
+    int line_len;
+
+    chat_presence_cb on_presence;
+    void *presence_ctx;
+};
+
+struct fixed_answers
+{
+    const char *username;
+    const char *color;
+    int color_asked;
+};
+
+static void *get_in_addr(struct sockaddr *sa)
+{
+    if(sa->sa_family == AF_INET)
+    {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+// Connect to host:port. Returns NULL if no address could be reached
+struct chat_client *chat_client_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *servinfo, *p;
+    struct chat_client *c;
+    int sockfd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(host, port, &hints, &servinfo) != 0)
+    {
+        return NULL;
+    }
+
+    for(p = servinfo; p != NULL; p = p->ai_next)
+    {
+        if((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        {
+            continue;
+        }
+        if(connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
+        {
+            close(sockfd);
+            continue;
+        }
+        break;
+    }
+
+    if(p == NULL)
+    {
+        freeaddrinfo(servinfo);
+        return NULL;
+    }
+
+    c = calloc(1, sizeof *c);
+    c->sockfd = sockfd;
+    inet_ntop(p->ai_family, get_in_addr((struct sockaddr*)p->ai_addr), c->peer, sizeof(c->peer));
+
+    freeaddrinfo(servinfo);
+    return c;
+}
+
+int chat_client_fd(struct chat_client *c)
+{
+    return c->sockfd;
+}
+
+const char *chat_client_peer(struct chat_client *c)
+{
+    return c->peer;
+}
+
+const char *chat_client_notice(struct chat_client *c)
+{
+    return c->notice;
+}
+
+// After a refused login, how many seconds the server asked us to wait before trying again. 0 if it gave no hint
+int chat_client_retry_after(struct chat_client *c)
+{
+    int seconds;
+
+    for(char *p = c->notice; *p != '\0'; ++p)
+    {
+        if(sscanf(p, RETRY_AFTER_HINT, &seconds) == 1)
+        {
+            return seconds;
+        }
+    }
+    return 0;
+}
+
+// Send a NUL-terminated handshake message, terminator included
+static int send_token(struct chat_client *c, const char *token)
+{
+    int nbytes = strlen(token) + 1;
+    return send(c->sockfd, token, nbytes, MSG_NOSIGNAL) == nbytes ? 0 : -1;
+}
+
+// Block until a whole NUL-terminated handshake message has arrived and copy it out
+static int recv_token(struct chat_client *c, char *token, int token_size)
+{
+    char *end;
+    int nbytes, consumed;
+
+    while((end = memchr(c->in, '\0', c->in_len)) == NULL)
+    {
+        if(c->in_len == RECVBUFSIZE)
+        {
+            return -1;
+        }
+        if((nbytes = recv(c->sockfd, c->in + c->in_len, RECVBUFSIZE - c->in_len, 0)) <= 0)
+        {
+            return -1;
+        }
+        c->in_len += nbytes;
+    }
+
+    consumed = end - c->in + 1;
+    snprintf(token, token_size, "%s", c->in);
+    c->in_len -= consumed;
+    memmove(c->in, c->in + consumed, c->in_len);
+    return 0;
+}
+
+// Keep the username the server repeats in the color prompt, since it cleans and shortens names. Failing that, what we sent
+static void confirm_username(struct chat_client *c, const char *color_prompt, const char *sent)
+{
+    const char *name = color_prompt + sizeof COLOR_PROMPT_NAME_PREFIX - 1;
+    const char *end;
+
+    if(strncmp(color_prompt, COLOR_PROMPT_NAME_PREFIX, sizeof COLOR_PROMPT_NAME_PREFIX - 1) != 0 ||
+       (end = strstr(name, COLOR_PROMPT_NAME_SUFFIX)) == NULL || end - name >= (int)sizeof c->username)
+    {
+        strcpy(c->username, sent);
+        return;
+    }
+    memcpy(c->username, name, end - name);
+    c->username[end - name] = '\0';
+}
+
+/*
+    Log in, asking prompt() for the username and color.
+    Returns 0 once joined, -1 if the server refused us (see chat_client_notice()) or the connection broke.
+*/
+int chat_client_handshake(struct chat_client *c, chat_prompt_cb prompt, void *ctx)
+{
+    char token[CHAT_CLIENT_MAX_LINE];
+    char answer[MAX_ANSWER_LENGTH];
+
+    // See if the server has enough room
+    if(recv_token(c, token, sizeof token) == -1)
+    {
+        return -1;
+    }
+    if(token[0] != '0')
+    {
+        snprintf(c->notice, sizeof c->notice, "%s", token);
+        return -1;
+    }
+
+    // Send confirmation message to server
+    if(send_token(c, "1") == -1)
+    {
+        return -1;
+    }
+
+    // Answer server's query for username. A name it cannot use gets a notice instead of the color prompt
+    if(recv_token(c, token, sizeof token) == -1 ||
+       prompt(ctx, token, answer, sizeof answer) == -1 ||
+       send_token(c, answer) == -1 ||
+       recv_token(c, token, sizeof token) == -1)
+    {
+        return -1;
+    }
+    if(strcmp(token, INVALID_USERNAME_NOTICE) == 0)
+    {
+        snprintf(c->notice, sizeof c->notice, "%s", token);
+        return -1;
+    }
+    confirm_username(c, token, answer);
+
+    // Answer server's query for color until it accepts one. After a refusal the next prompt follows the '0'
+    while(1)
+    {
+        if(prompt(ctx, token, answer, sizeof answer) == -1 ||
+           send_token(c, answer) == -1 ||
+           recv_token(c, token, sizeof token) == -1)
+        {
+            return -1;
+        }
+        if(token[0] != '0')
+        {
+            break;
+        }
+        if(recv_token(c, token, sizeof token) == -1)
+        {
+            return -1;
+        }
+    }
+
+    // Send confirmation message to server
+    if(send_token(c, "1") == -1)
+    {
+        return -1;
+    }
+
+    // Recieve server's joining confirmation message. Anything after it is already chat
+    return recv_token(c, c->notice, sizeof c->notice);
+}
+
+static int fixed_answer_prompt(void *ctx, const char *prompt, char *answer, int answer_size)
+{
+    struct fixed_answers *fa = ctx;
+
+    if(fa->username != NULL)
+    {
+        snprintf(answer, answer_size, "%s", fa->username);
+        fa->username = NULL;
+        return 0;
+    }
+
+    // A second color prompt means the first one was rejected, and asking again would give the same answer
+    if(fa->color_asked)
+    {
+        return -1;
+    }
+    fa->color_asked = 1;
+    snprintf(answer, answer_size, "%s", fa->color);
+    return 0;
+}
+
+// Log in without any interaction, for bots and scripted clients
+int chat_client_login(struct chat_client *c, const char *username, const char *color)
+{
+    struct fixed_answers fa = { username, color, 0 };
+
+    return chat_client_handshake(c, fixed_answer_prompt, &fa);
+}
+
+// Send one chat message. text should not include the LF; it and the string terminator are added here
+int chat_client_send_line(struct chat_client *c, const char *text, int nbytes)
+{
+    char msg[CHAT_CLIENT_MAX_LINE];
+
+    if(nbytes > CHAT_CLIENT_MAX_LINE - 2)
+    {
+        nbytes = CHAT_CLIENT_MAX_LINE - 2;
+    }
+    memcpy(msg, text, nbytes);
+    msg[nbytes++] = '\n';
+    msg[nbytes++] = '\0';
+
+    return send(c->sockfd, msg, nbytes, MSG_NOSIGNAL) == nbytes ? 0 : -1;
+}
+
+// Ask the server to show us as typing. Repeat at least every TYPING_TIMEOUT_MS while the user keeps typing
+int chat_client_send_typing(struct chat_client *c)
+{
+    return chat_client_send_line(c, TYPING_COMMAND, strlen(TYPING_COMMAND));
+}
+
+// Route presence frames to on_presence instead of the line callback. Without a handler they are dropped
+void chat_client_set_presence_handler(struct chat_client *c, chat_presence_cb on_presence, void *ctx)
+{
+    c->on_presence = on_presence;
+    c->presence_ctx = ctx;
+}
+
+// Turn a presence frame into the list of who else is typing, leaving ourselves out
+static void handle_presence_frame(struct chat_client *c, char *frame, int nbytes)
+{
+    char others[CHAT_CLIENT_MAX_LINE];
+    int others_len = 0;
+    char *name;
+
+    if(c->on_presence == NULL)
+    {
+        return;
+    }
+
+    // Skip the marker, and the LF unless the frame was cut short at a full line
+    if(frame[nbytes-1] == '\n')
+    {
+        nbytes--;
+    }
+    frame[nbytes] = '\0';
+    others[0] = '\0';
+
+    for(name = strtok(frame + 1, PRESENCE_NAME_SEPARATOR); name != NULL; name = strtok(NULL, PRESENCE_NAME_SEPARATOR))
+    {
+        if(strcmp(name, c->username) != 0)
+        {
+            others_len += snprintf(others + others_len, sizeof others - others_len, "%s%s", others_len > 0 ? PRESENCE_NAME_SEPARATOR : "", name);
+        }
+    }
+
+    c->on_presence(c->presence_ctx, others);
+}
+
+// Split data into lines, handing each complete line to on_line
+static void split_lines(struct chat_client *c, const char *buf, int nbytes, chat_line_cb on_line, void *ctx)
+{
+    for(int i = 0; i < nbytes; ++i)
+    {
+        // Messages are sent with their string terminator, which is not part of the text
+        if(buf[i] == '\0')
+        {
+            continue;
+        }
+
+        c->line[c->line_len++] = buf[i];
+
+        if(buf[i] == '\n' || c->line_len == CHAT_CLIENT_MAX_LINE)
+        {
+            if(c->line[0] == PRESENCE_FRAME_MARKER)
+            {
+                handle_presence_frame(c, c->line, c->line_len);
+            }
+            else
+            {
+                on_line(ctx, c->line, c->line_len);
+            }
+            c->line_len = 0;
+        }
+    }
+}
+
+/*
+    Read everything the server has sent so far without blocking, calling on_line for each complete line.
+    Returns -1 if the connection is gone.
+*/
+int chat_client_poll(struct chat_client *c, chat_line_cb on_line, void *ctx)
+{
+    int nbytes;
+
+    // Chat that arrived along with the end of the handshake
+    if(c->in_len > 0)
+    {
+        split_lines(c, c->in, c->in_len, on_line, ctx);
+        c->in_len = 0;
+    }
+
+    while((nbytes = recv(c->sockfd, c->in, RECVBUFSIZE, MSG_DONTWAIT)) > 0)
+    {
+        split_lines(c, c->in, nbytes, on_line, ctx);
+    }
+
+    if(nbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void chat_client_close(struct chat_client *c)
+{
+    close(c->sockfd);
+    free(c);
+}
@@ -0,0 +1,37 @@
+/*
+    Headless chatroom client.
+    Connects to a server, runs the login handshake and splits incoming chat into lines. Nothing here touches the
+    terminal, so the interactive client, bots and load generators can all share it.
+*/
+
+#pragma once
+
+#define CHAT_CLIENT_MAX_LINE 512
+
+struct chat_client;
+
+// Called with each piece of server text during login. Write the reply into answer (NUL-terminated) and return 0,
+// or return -1 to give up on the login
+typedef int (*chat_prompt_cb)(void *ctx, const char *prompt, char *answer, int answer_size);
+
+// Called with each complete line of chat, including its LF
+typedef void (*chat_line_cb)(void *ctx, const char *line, int nbytes);
+
+// Called when the set of other people typing in our room changes, as a comma separated list (empty if nobody is)
+typedef void (*chat_presence_cb)(void *ctx, const char *typing);
+
+struct chat_client *chat_client_connect(const char *host, const char *port);
+int chat_client_fd(struct chat_client *c);
+const char *chat_client_peer(struct chat_client *c);
+const char *chat_client_notice(struct chat_client *c);
+int chat_client_retry_after(struct chat_client *c);
+
+int chat_client_handshake(struct chat_client *c, chat_prompt_cb prompt, void *ctx);
+int chat_client_login(struct chat_client *c, const char *username, const char *color);
+
+int chat_client_send_line(struct chat_client *c, const char *text, int nbytes);
+int chat_client_send_typing(struct chat_client *c);
+void chat_client_set_presence_handler(struct chat_client *c, chat_presence_cb on_presence, void *ctx);
+int chat_client_poll(struct chat_client *c, chat_line_cb on_line, void *ctx);
+
+void chat_client_close(struct chat_client *c);
@@ -5,80 +5,93 @@
 #define _GNU_SOURCE
 
 #include "terminal.h"
+#include "chat_client.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <netdb.h>
-#include <sys/types.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#include <time.h>
+#include <sys/select.h>
 
 #define PORT "54060"
 #define MAXDATASIZE 512
+#define FRAME_INTERVAL_MS 33 // Incoming messages are drawn at most this often; anything faster is batched
+#define TYPING_NOTIFY_INTERVAL_MS 1000 // While the user types, remind the server this often
 
 char terminal_buf[MAXDATASIZE];
 int terminal_buf_len;
 
-int sockfd; // Socket that will be associated with this client.
+struct chat_client *client; // Connection to the server
 
+long long last_typing_notify_ms; // When we last told the server we are typing, 0 after a message is sent
 
-void *get_in_addr(struct sockaddr *sa)
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Show the server's login question and read the user's answer from the still-canonical terminal
+int prompt_user(void *ctx, const char *prompt, char *answer, int answer_size)
 {
-    if(sa->sa_family == AF_INET)
+    write(STDOUT_FILENO, prompt, strlen(prompt));
+
+    if(fgets(answer, answer_size, stdin) == NULL)
     {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
+        return -1;
     }
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    answer[strcspn(answer, "\n")] = '\0';
+    return 0;
 }
 
-void send_msg(int sockfd, char *buf, int buf_nbytes)
+void login_to_server()
 {
-    send(sockfd, buf, buf_nbytes, 0);
+    if(chat_client_handshake(client, prompt_user, NULL) == -1)
+    {
+        printf("%s\n", chat_client_notice(client));
+        exit(0);
+    }
+
+    // Joining confirmation
+    printf("%s\n", chat_client_notice(client));
+    fflush(stdout);
 }
 
-void login_to_server(int sockfd, char* buf)
+// Queue each complete line from the server for the next frame
+void handle_server_line(void *ctx, const char *line, int nbytes)
 {
-    int nbytes;
-    char confirmation_buf[2];
+    queue_to_term((char*)line, nbytes);
+}
 
-    // See if the server has enough room
-    nbytes = recv(sockfd, buf, 256, 0);
-    if(buf[0] != '0')
+// Show who else in the room is typing next to the input line
+void handle_presence(void *ctx, const char *typing)
+{
+    char status[MAXDATASIZE];
+
+    if(typing[0] == '\0')
     {
-        write(STDOUT_FILENO, buf, nbytes);
-        exit(0);
+        set_term_status("");
     }
-
-    // Send confirmation message to server
-    send(sockfd, "1", 2, 0);
-
-    // Answer server's query for username
-    nbytes = recv(sockfd, buf, 256, 0);
-    write(STDOUT_FILENO, buf, nbytes);
-    gets(buf);
-    send(sockfd, buf, strlen(buf)+1, 0);
-
-    // Answer server's query for color
-    do{
-        nbytes = recv(sockfd, buf, 256, 0);
-        write(STDOUT_FILENO, buf, nbytes);
-        gets(buf);
-        send(sockfd, buf, strlen(buf)+1, 0);
-        recv(sockfd, confirmation_buf, 2, 0);
+    else
+    {
+        snprintf(status, sizeof status, "%s typing", typing);
+        set_term_status(status);
     }
-    while(confirmation_buf[0] == '0');
-
-    // Send confirmation message to server
-    send(sockfd, "1", 2, 0);
+}
 
-    // Recieve server's joining confirmation message
-    nbytes = recv(sockfd, buf, 256, 0);
-    write(STDOUT_FILENO, buf, nbytes);
+// Let the server know we are typing, at most once per TYPING_NOTIFY_INTERVAL_MS
+void notify_typing()
+{
+    long long now = now_ms();
 
-    write(STDOUT_FILENO, "\n", 1);
+    if(now - last_typing_notify_ms >= TYPING_NOTIFY_INTERVAL_MS)
+    {
+        chat_client_send_typing(client);
+        last_typing_notify_ms = now;
+    }
 }
 
 void handle_terminal_input(char input)
@@ -90,10 +103,9 @@ void handle_terminal_input(char input)
 
         case 10: // LF
             clear_input_line();
-            terminal_buf[terminal_buf_len++] = 10; // LF
-            terminal_buf[terminal_buf_len] = '\0';
-            send_msg(sockfd, terminal_buf, terminal_buf_len+1);
+            chat_client_send_line(client, terminal_buf, terminal_buf_len);
             terminal_buf_len = 0;
+            last_typing_notify_ms = 0;
             break;
 
         case 127: //
@@ -103,13 +115,14 @@ void handle_terminal_input(char input)
                 write_backspace_to_input_line();
             }
             break;
-    
+
         default:
             if(terminal_buf_len < 254)
             {
                 terminal_buf[terminal_buf_len++] = input;
             }
             write_char_to_input_line(input);
+            notify_typing();
             break;
     }
 }
@@ -119,21 +132,21 @@ int main(int argc, char* argv[])
     fd_set master;
     fd_set read_fds;
     int fdmax;
+    int sockfd;
 
     char buf[MAXDATASIZE];
     int nbytes;
 
-    int i, rv;
-    char c;
+    int i;
 
-    struct addrinfo hints, *servinfo, *p;
+    struct timeval frame_timeout;
+    long long last_frame_ms = 0;
+    long long until_next_frame;
 
     terminal_buf_len = 0;
 
     FD_ZERO(&master);
     FD_ZERO(&read_fds);
-    
-    char s[INET6_ADDRSTRLEN];
 
     if(argc != 2)
     {
@@ -141,55 +154,49 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0)
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
-    }
-
-    for(p = servinfo; p != NULL; p = p->ai_next)
-    {
-        if((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-        {
-            perror("client: socket");
-            continue;
-        }
-        if(connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
-        {
-            perror("client: connect");
-            close(sockfd);
-            continue;
-        }
-        break;
-    }
-
-    if(p == NULL)
+    if((client = chat_client_connect(argv[1], PORT)) == NULL)
     {
         fprintf(stderr, "client: failed to connect\n");
         return 2;
     }
 
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr*)p->ai_addr), s, sizeof(s));
-    printf("client: connecting to %s\n", s);
+    printf("client: connecting to %s\n", chat_client_peer(client));
+
+    sockfd = chat_client_fd(client);
 
     FD_SET(STDIN_FILENO, &master);
     FD_SET(sockfd, &master);
 
     fdmax = sockfd;
 
-    login_to_server(sockfd, buf);
+    login_to_server();
 
     init_chat();
 
+    chat_client_set_presence_handler(client, handle_presence, NULL);
+
+    // Chat that arrived along with the end of the login
+    chat_client_poll(client, handle_server_line, NULL);
+
     while(1)
     {
         read_fds = master;
-        if(select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
+
+        // With output waiting, only sleep until it is due to be drawn
+        until_next_frame = last_frame_ms + FRAME_INTERVAL_MS - now_ms();
+        if(term_has_queued_output() && until_next_frame < 0)
         {
+            until_next_frame = 0;
+        }
+        frame_timeout.tv_sec = until_next_frame / 1000;
+        frame_timeout.tv_usec = (until_next_frame % 1000) * 1000;
+
+        if(select(fdmax+1, &read_fds, NULL, NULL, term_has_queued_output() ? &frame_timeout : NULL) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
             perror("select");
             exit(4);
         }
@@ -201,26 +208,33 @@ int main(int argc, char* argv[])
                 // Incoming data from server
                 if(i == sockfd)
                 {
-                    if((nbytes = recv(sockfd, buf, MAXDATASIZE, 0)) <= 0)
+                    if(chat_client_poll(client, handle_server_line, NULL) == -1)
                     {
                         printf("Lost connection to server");
                         exit(0);
                     }
-                    write_to_term(buf, nbytes);
                 }
-                
+
                 // User is typing
                 else if(i == STDIN_FILENO)
                 {
-                    c = read_char();
+                    nbytes = read_chars(buf, MAXDATASIZE);
 
-                    handle_terminal_input(c);
+                    for(int j = 0; j < nbytes; ++j)
+                    {
+                        handle_terminal_input(buf[j]);
+                    }
                 }
             }
         }
+
+        if(term_has_queued_output() && now_ms() - last_frame_ms >= FRAME_INTERVAL_MS)
+        {
+            flush_term(terminal_buf, terminal_buf_len);
+            last_frame_ms = now_ms();
+        }
     }
 
-    freeaddrinfo(servinfo);
-    close(sockfd);
+    chat_client_close(client);
     return 0;
-}
\ No newline at end of file
+}
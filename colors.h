@@ -0,0 +1,64 @@
+/*
+    Display colors, the single table the login prompt, the color parser and every colored name are built from.
+    Adding a color is one line here. The escape can be any SGR sequence, so 256-color (38;5;n) and truecolor
+    (38;2;r;g;b) entries work the same as the basic eight. Keep existing entries in place, since users carry their
+    color's index across a --takeover restart.
+*/
+
+#pragma once
+
+// X(id, name, escape, who may use it: USER or SERVER)
+#define COLOR_TABLE(X) \
+    X(COLOR_RESET,   "reset",   "\x1B[0m",        SERVER) \
+    X(COLOR_RED,     "red",     "\x1B[31m",       SERVER) \
+    X(COLOR_GREEN,   "green",   "\x1B[32m",       USER) \
+    X(COLOR_YELLOW,  "yellow",  "\x1B[33m",       USER) \
+    X(COLOR_BLUE,    "blue",    "\x1B[34m",       USER) \
+    X(COLOR_MAGENTA, "magenta", "\x1B[35m",       USER) \
+    X(COLOR_CYAN,    "cyan",    "\x1B[36m",       USER) \
+    X(COLOR_WHITE,   "white",   "\x1B[37m",       USER) \
+    X(COLOR_ORANGE,  "orange",  "\x1B[38;5;208m", USER) \
+    X(COLOR_PINK,    "pink",    "\x1B[38;5;213m", USER)
+
+#define COLOR_SERVER_NAME COLOR_RED // The server's own name in its messages
+
+// Only its size is used: the longest escape in the table, for sizing buffers that hold colored text
+union color_escape_sizes
+{
+#define COLOR_ESCAPE_SIZE(id, name, escape, who) char id[sizeof(escape)];
+    COLOR_TABLE(COLOR_ESCAPE_SIZE)
+#undef COLOR_ESCAPE_SIZE
+};
+
+#define COLOR_MAX_ESCAPE (sizeof(union color_escape_sizes) - 1)
+
+enum color_id
+{
+#define COLOR_ENUM(id, name, escape, who) id,
+    COLOR_TABLE(COLOR_ENUM)
+#undef COLOR_ENUM
+    COLOR_COUNT
+};
+
+struct color
+{
+    const char *name;
+    const char *escape;
+    int escape_nbytes;
+    int selectable;
+};
+
+#define COLOR_SELECTABLE_USER 1
+#define COLOR_SELECTABLE_SERVER 0
+
+static const struct color colors[COLOR_COUNT] = {
+#define COLOR_ENTRY(id, name, escape, who) {name, escape, sizeof(escape) - 1, COLOR_SELECTABLE_##who},
+    COLOR_TABLE(COLOR_ENTRY)
+#undef COLOR_ENTRY
+};
+
+// The colors users may pick, each shown in itself, as one string literal for the login prompt: " green yellow ..."
+#define COLOR_OPTION_USER(name, escape) " " escape name "\x1B[0m"
+#define COLOR_OPTION_SERVER(name, escape)
+#define COLOR_OPTION(id, name, escape, who) COLOR_OPTION_##who(name, escape)
+#define COLOR_PROMPT_OPTIONS COLOR_TABLE(COLOR_OPTION)
@@ -0,0 +1,445 @@
+/*
+    Event loop front end and the epoll backend.
+*/
+
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+enum fd_role
+{
+    ROLE_LISTENER,
+    ROLE_READER,
+    ROLE_CLIENT
+};
+
+// A send that hit a full socket buffer and is waiting for EPOLLOUT
+struct pending_send
+{
+    struct msghdr *msg;
+    void *cookie;
+};
+
+struct epoll_loop
+{
+    struct event_loop base;
+    int epfd;
+    char bufs[EVENT_LOOP_MAX_EVENTS][EVENT_LOOP_BUF_SIZE+1];
+
+    // Indexed by fd; at most one send is outstanding per fd
+    struct pending_send *pending;
+    int pending_cap;
+
+    // Finished sends, and the ends of stopped reads, not yet handed out by wait
+    struct event *done;
+    int done_count;
+    int done_cap;
+};
+
+/*
+    Front end.
+*/
+
+struct event_loop *event_loop_create()
+{
+    struct event_loop *loop = event_loop_create_uring();
+
+    if(loop == NULL)
+    {
+        loop = event_loop_create_epoll();
+    }
+    return loop;
+}
+
+const char *event_loop_backend_name(struct event_loop *loop)
+{
+    return loop->ops->name;
+}
+
+int event_loop_add_listener(struct event_loop *loop, int fd)
+{
+    return loop->ops->add_listener(loop, fd);
+}
+
+int event_loop_add_reader(struct event_loop *loop, int fd)
+{
+    return loop->ops->add_reader(loop, fd);
+}
+
+int event_loop_add_client(struct event_loop *loop, int fd)
+{
+    return loop->ops->add_client(loop, fd);
+}
+
+int event_loop_remove(struct event_loop *loop, int fd)
+{
+    return loop->ops->remove(loop, fd);
+}
+
+/*
+    Stop receiving from client fd without losing what the loop has already read from it. Data read before the stop
+    still comes out as EVENT_DATA, then one EVENT_DATA with result -ECANCELED says nothing more will. Sends still
+    outstanding on fd are cancelled. Whatever the client sends afterwards stays in the socket.
+*/
+int event_loop_stop_reading(struct event_loop *loop, int fd)
+{
+    return loop->ops->stop_reading(loop, fd);
+}
+
+// Block until at least one event is ready or timeout_ms passes (-1 waits forever). Returns the number of events filled in
+int event_loop_wait(struct event_loop *loop, struct event *events, int max_events, int timeout_ms)
+{
+    return loop->ops->wait(loop, events, max_events, timeout_ms);
+}
+
+void event_loop_release(struct event_loop *loop, struct event *ev)
+{
+    loop->ops->release(loop, ev);
+}
+
+/*
+    Start sending msg on fd. Completion is reported by an EVENT_SENT carrying cookie, which may come out of the very
+    next wait. msg, its iovecs and the data they point at must stay untouched until then, and only one send may be
+    outstanding per fd. Sends queued in the same loop iteration go to the kernel together where the backend allows.
+    Returns -1 if the loop had no memory to track the send; then nothing was sent and no EVENT_SENT will follow.
+*/
+int event_loop_sendmsg(struct event_loop *loop, int fd, struct msghdr *msg, void *cookie)
+{
+    return loop->ops->sendmsg(loop, fd, msg, cookie);
+}
+
+void event_loop_destroy(struct event_loop *loop)
+{
+    loop->ops->destroy(loop);
+}
+
+/*
+    epoll backend.
+*/
+
+static int epoll_loop_ctl(struct epoll_loop *el, int op, int fd, enum fd_role role, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.u64 = ((uint64_t)role << 32) | (uint32_t)fd;
+
+    if(epoll_ctl(el->epfd, op, fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static int epoll_loop_add(struct event_loop *loop, int fd, enum fd_role role)
+{
+    return epoll_loop_ctl((struct epoll_loop*)loop, EPOLL_CTL_ADD, fd, role, EPOLLIN);
+}
+
+// Make room to record one more finished send. Done before sending, so a send that went out is never lost for want of it
+static int epoll_loop_reserve_done(struct epoll_loop *el)
+{
+    struct event *done;
+    int cap;
+
+    if(el->done_count < el->done_cap)
+    {
+        return 0;
+    }
+
+    cap = el->done_cap ? el->done_cap * 2 : EVENT_LOOP_MAX_EVENTS;
+    if((done = realloc(el->done, cap * sizeof(struct event))) == NULL)
+    {
+        return -1;
+    }
+    el->done = done;
+    el->done_cap = cap;
+    return 0;
+}
+
+// Record a finished send for the next wait to hand out. Room for it must have been reserved
+static void epoll_loop_complete_send(struct epoll_loop *el, int fd, int result, void *cookie)
+{
+    struct event *ev = &el->done[el->done_count++];
+
+    memset(ev, 0, sizeof *ev);
+    ev->type = EVENT_SENT;
+    ev->fd = fd;
+    ev->result = result;
+    ev->buf_id = -1;
+    ev->cookie = cookie;
+}
+
+/*
+    Try a send without blocking. Returns 0 if it finished (fully or not), -1 if the socket buffer is full and -2 if
+    there is no memory to record the result, in which case it was not tried.
+*/
+static int epoll_loop_try_send(struct epoll_loop *el, int fd, struct msghdr *msg, void *cookie)
+{
+    int rv;
+
+    if(epoll_loop_reserve_done(el) == -1)
+    {
+        return -2;
+    }
+
+    rv = sendmsg(fd, msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return -1;
+    }
+
+    epoll_loop_complete_send(el, fd, rv == -1 ? -errno : rv, cookie);
+    return 0;
+}
+
+static int epoll_loop_add_listener(struct event_loop *loop, int fd)
+{
+    return epoll_loop_add(loop, fd, ROLE_LISTENER);
+}
+
+static int epoll_loop_add_reader(struct event_loop *loop, int fd)
+{
+    return epoll_loop_add(loop, fd, ROLE_READER);
+}
+
+static int epoll_loop_add_client(struct event_loop *loop, int fd)
+{
+    return epoll_loop_add(loop, fd, ROLE_CLIENT);
+}
+
+static int epoll_loop_remove(struct event_loop *loop, int fd)
+{
+    struct epoll_loop *el = (struct epoll_loop*)loop;
+
+    // A send still waiting on this fd will never finish now. With no memory to report that, its owner is leaked
+    if(fd < el->pending_cap && el->pending[fd].msg != NULL && epoll_loop_reserve_done(el) == 0)
+    {
+        epoll_loop_complete_send(el, fd, -ECANCELED, el->pending[fd].cookie);
+        el->pending[fd].msg = NULL;
+    }
+
+    return epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Reads happen inside wait, so once fd is out of the epoll set nothing more is read and the end can be reported at once
+static int epoll_loop_stop_reading(struct event_loop *loop, int fd)
+{
+    struct epoll_loop *el = (struct epoll_loop*)loop;
+    struct event *ev;
+
+    if(epoll_loop_remove(loop, fd) == -1 || epoll_loop_reserve_done(el) == -1)
+    {
+        return -1;
+    }
+
+    ev = &el->done[el->done_count++];
+    memset(ev, 0, sizeof *ev);
+    ev->type = EVENT_DATA;
+    ev->fd = fd;
+    ev->result = -ECANCELED;
+    ev->buf_id = -1;
+    return 0;
+}
+
+static int epoll_loop_sendmsg(struct event_loop *loop, int fd, struct msghdr *msg, void *cookie)
+{
+    struct epoll_loop *el = (struct epoll_loop*)loop;
+    struct pending_send *pending;
+    int rv, cap;
+
+    if((rv = epoll_loop_try_send(el, fd, msg, cookie)) != -1)
+    {
+        return rv == 0 ? 0 : -1;
+    }
+
+    if(fd >= el->pending_cap)
+    {
+        cap = fd + 64;
+        if((pending = realloc(el->pending, cap * sizeof(struct pending_send))) == NULL)
+        {
+            return -1;
+        }
+        memset(pending + el->pending_cap, 0, (cap - el->pending_cap) * sizeof(struct pending_send));
+        el->pending = pending;
+        el->pending_cap = cap;
+    }
+
+    el->pending[fd].msg = msg;
+    el->pending[fd].cookie = cookie;
+    return epoll_loop_ctl(el, EPOLL_CTL_MOD, fd, ROLE_CLIENT, EPOLLIN | EPOLLOUT);
+}
+
+// The socket has room again, so retry the send that was waiting on it. If it cannot go yet, EPOLLOUT brings us back
+static void epoll_loop_resume_send(struct epoll_loop *el, int fd)
+{
+    struct pending_send *ps;
+
+    if(fd >= el->pending_cap)
+    {
+        return;
+    }
+
+    ps = &el->pending[fd];
+    if(ps->msg == NULL || epoll_loop_try_send(el, fd, ps->msg, ps->cookie) != 0)
+    {
+        return;
+    }
+
+    ps->msg = NULL;
+    epoll_loop_ctl(el, EPOLL_CTL_MOD, fd, ROLE_CLIENT, EPOLLIN);
+}
+
+static int epoll_loop_wait(struct event_loop *loop, struct event *events, int max_events, int timeout_ms)
+{
+    struct epoll_loop *el = (struct epoll_loop*)loop;
+    struct epoll_event ready[EVENT_LOOP_MAX_EVENTS];
+    struct event *ev;
+    int nready, n = 0, ndone, fd;
+
+    if(max_events > EVENT_LOOP_MAX_EVENTS)
+    {
+        max_events = EVENT_LOOP_MAX_EVENTS;
+    }
+
+    // Finished sends are already waiting to be handed out, so only poll
+    nready = epoll_wait(el->epfd, ready, max_events, el->done_count > 0 ? 0 : timeout_ms);
+    if(nready == -1)
+    {
+        if(errno != EINTR)
+        {
+            return -1;
+        }
+        nready = 0;
+    }
+
+    for(int i = 0; i < nready; ++i)
+    {
+        fd = (int)(uint32_t)ready[i].data.u64;
+        ev = &events[n];
+        ev->fd = fd;
+        ev->data = NULL;
+        ev->buf_id = -1;
+        ev->cookie = NULL;
+
+        switch(ready[i].data.u64 >> 32)
+        {
+            case ROLE_LISTENER:
+                ev->type = EVENT_ACCEPT;
+                ev->result = accept(fd, NULL, NULL);
+                if(ev->result == -1)
+                {
+                    ev->result = -errno;
+                }
+                n++;
+                break;
+
+            case ROLE_READER:
+                ev->type = EVENT_READABLE;
+                ev->result = 0;
+                n++;
+                break;
+
+            case ROLE_CLIENT:
+                if(ready[i].events & EPOLLOUT)
+                {
+                    epoll_loop_resume_send(el, fd);
+                }
+                if(!(ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                {
+                    break;
+                }
+
+                ev->type = EVENT_DATA;
+                ev->data = el->bufs[n];
+                ev->result = recv(fd, el->bufs[n], EVENT_LOOP_BUF_SIZE, MSG_DONTWAIT);
+                if(ev->result < 0)
+                {
+                    ev->result = -errno;
+                    el->bufs[n][0] = '\0';
+
+                    // Nothing to read after all, e.g. EPOLLERR from a send
+                    if(ev->result == -EAGAIN)
+                    {
+                        break;
+                    }
+                }
+                else
+                {
+                    el->bufs[n][ev->result] = '\0';
+                }
+                n++;
+                break;
+        }
+    }
+
+    ndone = el->done_count < max_events - n ? el->done_count : max_events - n;
+    memcpy(events + n, el->done, ndone * sizeof(struct event));
+    el->done_count -= ndone;
+    memmove(el->done, el->done + ndone, el->done_count * sizeof(struct event));
+
+    return n + ndone;
+}
+
+static void epoll_loop_release(struct event_loop *loop, struct event *ev)
+{
+    // Buffers belong to the loop and are reused by the next wait
+}
+
+static void epoll_loop_destroy(struct event_loop *loop)
+{
+    struct epoll_loop *el = (struct epoll_loop*)loop;
+
+    close(el->epfd);
+    free(el->pending);
+    free(el->done);
+    free(el);
+}
+
+static const struct event_loop_ops epoll_ops = {
+    "epoll",
+    epoll_loop_add_listener,
+    epoll_loop_add_reader,
+    epoll_loop_add_client,
+    epoll_loop_remove,
+    epoll_loop_stop_reading,
+    epoll_loop_wait,
+    epoll_loop_release,
+    epoll_loop_sendmsg,
+    epoll_loop_destroy
+};
+
+struct event_loop *event_loop_create_epoll()
+{
+    struct epoll_loop *el = calloc(1, sizeof *el);
+
+    if(el == NULL)
+    {
+        return NULL;
+    }
+
+    if((el->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        perror("epoll_create1");
+        free(el);
+        return NULL;
+    }
+    el->base.ops = &epoll_ops;
+    return &el->base;
+}
+
+#ifndef HAVE_IO_URING
+struct event_loop *event_loop_create_uring()
+{
+    return NULL;
+}
+#endif
@@ -0,0 +1,66 @@
+/*
+    Event loop used by the server's main thread.
+    Hides whether readiness/completions come from epoll or io_uring. io_uring is tried first (when built in) and
+    epoll is used as the fallback.
+*/
+
+#pragma once
+
+#include <sys/socket.h>
+
+#define EVENT_LOOP_BUF_SIZE 512 // Largest chunk of client data delivered by a single EVENT_DATA
+#define EVENT_LOOP_MAX_EVENTS 64
+
+enum event_type
+{
+    EVENT_ACCEPT,   // A listener accepted a connection; result is the new fd (or -errno)
+    EVENT_READABLE, // A plain fd (stdin, pipe) has data waiting; the caller reads it
+    EVENT_DATA,     // Data arrived from a client; result follows recv() semantics (0 = closed, <0 = -errno)
+    EVENT_SENT      // An event_loop_sendmsg() finished; result is the bytes sent (possibly short) or -errno
+};
+
+struct event
+{
+    enum event_type type;
+    int fd;
+    int result;
+    char *data;     // EVENT_DATA only, NUL-terminated at data[result]. Hand back with event_loop_release()
+    int buf_id;
+    void *cookie;   // EVENT_SENT only, as passed to event_loop_sendmsg()
+};
+
+struct event_loop;
+
+struct event_loop_ops
+{
+    const char *name;
+    int (*add_listener)(struct event_loop *loop, int fd);
+    int (*add_reader)(struct event_loop *loop, int fd);
+    int (*add_client)(struct event_loop *loop, int fd);
+    int (*remove)(struct event_loop *loop, int fd);
+    int (*stop_reading)(struct event_loop *loop, int fd);
+    int (*wait)(struct event_loop *loop, struct event *events, int max_events, int timeout_ms);
+    void (*release)(struct event_loop *loop, struct event *ev);
+    int (*sendmsg)(struct event_loop *loop, int fd, struct msghdr *msg, void *cookie);
+    void (*destroy)(struct event_loop *loop);
+};
+
+struct event_loop
+{
+    const struct event_loop_ops *ops;
+};
+
+struct event_loop *event_loop_create();
+struct event_loop *event_loop_create_epoll();
+struct event_loop *event_loop_create_uring(); // Returns NULL if io_uring is not built in or not usable
+
+const char *event_loop_backend_name(struct event_loop *loop);
+int event_loop_add_listener(struct event_loop *loop, int fd);
+int event_loop_add_reader(struct event_loop *loop, int fd);
+int event_loop_add_client(struct event_loop *loop, int fd);
+int event_loop_remove(struct event_loop *loop, int fd);
+int event_loop_stop_reading(struct event_loop *loop, int fd);
+int event_loop_wait(struct event_loop *loop, struct event *events, int max_events, int timeout_ms);
+void event_loop_release(struct event_loop *loop, struct event *ev);
+int event_loop_sendmsg(struct event_loop *loop, int fd, struct msghdr *msg, void *cookie);
+void event_loop_destroy(struct event_loop *loop);
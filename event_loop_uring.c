@@ -0,0 +1,934 @@
+/*
+    io_uring backend for the event loop, driven through the raw syscalls so no liburing is needed.
+
+    Listeners use multishot accept, clients use multishot recv into a provided buffer ring and plain fds use multishot
+    poll, so a steady stream of traffic is delivered without re-arming anything. Sends are only queued when asked for
+    and go to the kernel together with the next wait, so a broadcast to every client costs a single io_uring_enter().
+*/
+
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUF_COUNT 256         // Provided buffers shared by every client recv; must be a power of 2
+#define URING_BUF_GROUP 0
+#define URING_MAX_FDS 65536
+#define URING_ZC_SEND_THRESHOLD 4096 // Below this, pinning pages for a zero-copy send costs more than copying
+
+// user_data layout: | kind (8) | generation (24) | fd (32) |. Sends carry the index of their uring_send in place of the fd
+#define UD_SEND 0
+#define UD_ACCEPT 1
+#define UD_POLL 2
+#define UD_RECV 3
+#define UD_CANCEL 4
+
+#define UD_MAKE(kind, gen, fd) (((uint64_t)(kind) << 56) | ((uint64_t)((gen) & 0xFFFFFF) << 32) | (uint32_t)(fd))
+#define UD_KIND(ud) ((int)((ud) >> 56))
+#define UD_GEN(ud) ((unsigned)(((ud) >> 32) & 0xFFFFFF))
+#define UD_FD(ud) ((int)(uint32_t)(ud))
+
+// An outstanding send. Zero-copy sends complete in two CQEs, so the result of the first is held here for the second
+struct uring_send
+{
+    int fd;
+    int result;
+    void *cookie;
+    int next_free;
+};
+
+struct uring_loop
+{
+    struct event_loop base;
+    int ring_fd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *bufs;
+    unsigned short buf_tail;
+    int bufs_out; // Handed to the caller in events and not released yet
+
+    int zc_send;
+    struct uring_send *sends; // Indexed by the id in a send's user_data
+    int sends_cap;
+    int free_send; // First unused entry of sends, -1 if all are in use
+
+    // SQEs made while the ring was full and the kernel would take no more (EBUSY), in order, for the next submit
+    struct io_uring_sqe *backlog;
+    int backlog_count;
+    int backlog_cap;
+
+    // Clients whose multishot recv ended for lack of buffers, oldest first in a ring, to be re-armed one for each
+    // buffer handed back
+    int starved[URING_MAX_FDS];
+    int starved_head;
+    int nstarved;
+    unsigned char is_starved[URING_MAX_FDS];
+
+    unsigned gen[URING_MAX_FDS]; // Bumped when an fd is removed so completions for its old owner are dropped
+
+    // Clients whose reads are being stopped: their recv is cancelled but what it already read is still delivered.
+    // Once it has ended they are listed in stopped until wait reports that
+    unsigned char stopping[URING_MAX_FDS];
+    int stopped[URING_MAX_FDS];
+    int nstopped;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static char *uring_buf(struct uring_loop *ul, int bid)
+{
+    return ul->bufs + (size_t)bid * (EVENT_LOOP_BUF_SIZE+1);
+}
+
+// Hand a buffer back to the kernel's provided buffer ring
+static void uring_recycle_buf(struct uring_loop *ul, int bid)
+{
+    struct io_uring_buf *b = &ul->buf_ring->bufs[ul->buf_tail & (URING_BUF_COUNT-1)];
+
+    b->addr = (uint64_t)(uintptr_t)uring_buf(ul, bid);
+    b->len = EVENT_LOOP_BUF_SIZE;
+    b->bid = bid;
+    ul->buf_tail++;
+    __atomic_store_n(&ul->buf_ring->tail, ul->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Whether every entry of the submission ring is taken, by SQEs the kernel has not consumed yet
+static int uring_sq_full(struct uring_loop *ul)
+{
+    return ul->sq_local_tail - __atomic_load_n(ul->sq_head, __ATOMIC_ACQUIRE) >= URING_ENTRIES;
+}
+
+// Move SQEs held back while the ring was full into it, as many as now fit
+static void uring_drain_backlog(struct uring_loop *ul)
+{
+    unsigned idx;
+    int n = 0;
+
+    while(n < ul->backlog_count && !uring_sq_full(ul))
+    {
+        idx = ul->sq_local_tail & *ul->sq_mask;
+        ul->sqes[idx] = ul->backlog[n++];
+        ul->sq_array[idx] = idx;
+        ul->sq_local_tail++;
+    }
+
+    ul->backlog_count -= n;
+    memmove(ul->backlog, ul->backlog + n, ul->backlog_count * sizeof *ul->backlog);
+}
+
+/*
+    Push every queued SQE to the kernel, optionally waiting for completions. Entries an earlier call left behind
+    (EBUSY, or a short submit) are counted again, since the kernel takes them from the head of the ring.
+*/
+static int uring_submit(struct uring_loop *ul, unsigned min_complete, int timeout_ms)
+{
+    unsigned to_submit;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int rv;
+
+    uring_drain_backlog(ul);
+    to_submit = ul->sq_local_tail - __atomic_load_n(ul->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ul->sq_tail, ul->sq_local_tail, __ATOMIC_RELEASE);
+
+    if(min_complete > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(timeout_ms >= 0)
+        {
+            memset(&arg, 0, sizeof arg);
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            rv = sys_io_uring_enter(ul->ring_fd, to_submit, min_complete, flags, &arg, sizeof arg);
+        }
+        else
+        {
+            rv = sys_io_uring_enter(ul->ring_fd, to_submit, min_complete, flags, NULL, 0);
+        }
+    }
+    else if(to_submit == 0)
+    {
+        return 0;
+    }
+    else
+    {
+        rv = sys_io_uring_enter(ul->ring_fd, to_submit, 0, 0, NULL, 0);
+    }
+
+    if(rv == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+        perror("io_uring_enter");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Grab a free SQE, flushing the queue to the kernel first if it is full. If the kernel takes none (EBUSY until
+    completions are reaped) it comes from the backlog instead, and so does every SQE after it until the backlog is
+    drained, so they reach the kernel in order. Returns NULL if the backlog is needed and cannot grow.
+*/
+static struct io_uring_sqe *uring_get_sqe(struct uring_loop *ul)
+{
+    struct io_uring_sqe *sqe, *backlog;
+    unsigned idx;
+    int cap;
+
+    if(ul->backlog_count == 0 && uring_sq_full(ul))
+    {
+        uring_submit(ul, 0, -1);
+    }
+
+    if(ul->backlog_count > 0 || uring_sq_full(ul))
+    {
+        if(ul->backlog_count == ul->backlog_cap)
+        {
+            cap = ul->backlog_cap ? ul->backlog_cap * 2 : URING_ENTRIES;
+            if((backlog = realloc(ul->backlog, cap * sizeof *backlog)) == NULL)
+            {
+                return NULL;
+            }
+            ul->backlog = backlog;
+            ul->backlog_cap = cap;
+        }
+        sqe = &ul->backlog[ul->backlog_count++];
+    }
+    else
+    {
+        idx = ul->sq_local_tail & *ul->sq_mask;
+        sqe = &ul->sqes[idx];
+        ul->sq_array[idx] = idx;
+        ul->sq_local_tail++;
+    }
+
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+static int uring_prep_accept(struct uring_loop *ul, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ul);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD_MAKE(UD_ACCEPT, ul->gen[fd], fd);
+    return 0;
+}
+
+static int uring_prep_poll(struct uring_loop *ul, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ul);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD_MAKE(UD_POLL, ul->gen[fd], fd);
+    return 0;
+}
+
+static int uring_prep_recv(struct uring_loop *ul, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ul);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = 1U << IOSQE_BUFFER_SELECT_BIT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = UD_MAKE(UD_RECV, ul->gen[fd], fd);
+    return 0;
+}
+
+// A client's recv ended for lack of buffers. Re-arming it now would only fail again, so wait for one to come back
+static void uring_starve(struct uring_loop *ul, int fd)
+{
+    if(!ul->is_starved[fd])
+    {
+        ul->is_starved[fd] = 1;
+        ul->starved[(ul->starved_head + ul->nstarved++) % URING_MAX_FDS] = fd;
+    }
+}
+
+// Take fd out of the starved ring, keeping the others in order
+static void uring_unstarve(struct uring_loop *ul, int fd)
+{
+    int i = 0;
+
+    if(!ul->is_starved[fd])
+    {
+        return;
+    }
+    while(ul->starved[(ul->starved_head + i) % URING_MAX_FDS] != fd)
+    {
+        i++;
+    }
+    for(; i < ul->nstarved - 1; ++i)
+    {
+        ul->starved[(ul->starved_head + i) % URING_MAX_FDS] = ul->starved[(ul->starved_head + i + 1) % URING_MAX_FDS];
+    }
+    ul->nstarved--;
+    ul->is_starved[fd] = 0;
+}
+
+// A stopped client's recv has ended, so wait can report that nothing more will be read
+static void uring_stop_done(struct uring_loop *ul, int fd)
+{
+    ul->stopping[fd] = 0;
+    ul->stopped[ul->nstopped++] = fd;
+}
+
+/*
+    Re-arm up to count of the recvs that ran out of buffers, longest waiting first. Each can take a buffer, so re-arming
+    more than came back would only starve the rest again. Any that still find none go to the back of the ring.
+*/
+static void uring_rearm_starved(struct uring_loop *ul, int count)
+{
+    int fd;
+
+    while(ul->nstarved > 0 && count-- > 0)
+    {
+        fd = ul->starved[ul->starved_head];
+        if(uring_prep_recv(ul, fd) == -1)
+        {
+            return;
+        }
+        ul->is_starved[fd] = 0;
+        ul->starved_head = (ul->starved_head + 1) % URING_MAX_FDS;
+        ul->nstarved--;
+    }
+}
+
+// Hand a buffer back to the kernel, which is what starved recvs are waiting for
+static void uring_return_buf(struct uring_loop *ul, int bid)
+{
+    uring_recycle_buf(ul, bid);
+    uring_rearm_starved(ul, 1);
+}
+
+static int uring_add_listener(struct event_loop *loop, int fd)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+
+    if(fd >= URING_MAX_FDS || uring_prep_accept(ul, fd) == -1)
+    {
+        return -1;
+    }
+    return uring_submit(ul, 0, -1);
+}
+
+static int uring_add_reader(struct event_loop *loop, int fd)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+
+    if(fd >= URING_MAX_FDS || uring_prep_poll(ul, fd) == -1)
+    {
+        return -1;
+    }
+    return uring_submit(ul, 0, -1);
+}
+
+static int uring_add_client(struct event_loop *loop, int fd)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+
+    if(fd >= URING_MAX_FDS || uring_prep_recv(ul, fd) == -1)
+    {
+        return -1;
+    }
+    return uring_submit(ul, 0, -1);
+}
+
+// Cancel whatever is armed on fd. The caller is about to close it, so this goes out immediately
+static int uring_remove(struct event_loop *loop, int fd)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+    struct io_uring_sqe *sqe;
+
+    if(fd >= URING_MAX_FDS)
+    {
+        return -1;
+    }
+
+    // Its owner is going, so it is no longer waiting for a buffer
+    uring_unstarve(ul, fd);
+    ul->gen[fd]++;
+
+    // Nor is anyone waiting to hear its reads have stopped
+    ul->stopping[fd] = 0;
+    for(int i = 0; i < ul->nstopped; ++i)
+    {
+        if(ul->stopped[i] == fd)
+        {
+            ul->stopped[i] = ul->stopped[--ul->nstopped];
+            break;
+        }
+    }
+
+    if((sqe = uring_get_sqe(ul)) == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = UD_MAKE(UD_CANCEL, 0, fd);
+
+    return uring_submit(ul, 0, -1);
+}
+
+// Cancel fd's recv but keep its generation, so data it read before the cancel took effect is still delivered
+static int uring_stop_reading(struct event_loop *loop, int fd)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+    struct io_uring_sqe *sqe;
+
+    if(fd >= URING_MAX_FDS || ul->stopping[fd])
+    {
+        return -1;
+    }
+
+    // No recv is armed while it waits for a buffer, so it has already ended
+    if(ul->is_starved[fd])
+    {
+        uring_unstarve(ul, fd);
+        uring_stop_done(ul, fd);
+        return 0;
+    }
+
+    if((sqe = uring_get_sqe(ul)) == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = UD_MAKE(UD_CANCEL, 0, fd);
+    ul->stopping[fd] = 1;
+
+    return uring_submit(ul, 0, -1);
+}
+
+// Take an unused uring_send, growing the table if they are all in use. Returns its id, or -1 if it cannot grow
+static int uring_alloc_send(struct uring_loop *ul)
+{
+    struct uring_send *sends;
+    int id, cap;
+
+    if(ul->free_send == -1)
+    {
+        cap = ul->sends_cap ? ul->sends_cap * 2 : URING_ENTRIES;
+        if((sends = realloc(ul->sends, cap * sizeof *sends)) == NULL)
+        {
+            return -1;
+        }
+        for(id = ul->sends_cap; id < cap; ++id)
+        {
+            sends[id].next_free = id + 1 < cap ? id + 1 : -1;
+        }
+        ul->free_send = ul->sends_cap;
+        ul->sends = sends;
+        ul->sends_cap = cap;
+    }
+
+    id = ul->free_send;
+    ul->free_send = ul->sends[id].next_free;
+    return id;
+}
+
+static void uring_free_send(struct uring_loop *ul, int id)
+{
+    ul->sends[id].next_free = ul->free_send;
+    ul->free_send = id;
+}
+
+// Report a finished send to the caller and recycle its bookkeeping
+static void uring_send_done(struct uring_loop *ul, int id, struct event *ev)
+{
+    struct uring_send *us = &ul->sends[id];
+
+    memset(ev, 0, sizeof *ev);
+    ev->type = EVENT_SENT;
+    ev->fd = us->fd;
+    ev->result = us->result;
+    ev->buf_id = -1;
+    ev->cookie = us->cookie;
+
+    uring_free_send(ul, id);
+}
+
+// Turn one CQE into an event for the caller. Returns 1 if ev was filled in, 0 if the CQE was handled internally
+static int uring_handle_cqe(struct uring_loop *ul, struct io_uring_cqe *cqe, struct event *ev)
+{
+    uint64_t ud = cqe->user_data;
+    int kind = UD_KIND(ud);
+    int fd = UD_FD(ud);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int bid;
+
+    // For a send the low half is the id of its uring_send
+    if(kind == UD_SEND)
+    {
+        struct uring_send *us = &ul->sends[fd];
+
+        // Zero-copy sends post a second, final CQE once the kernel lets go of the pages
+        if(!(cqe->flags & IORING_CQE_F_NOTIF))
+        {
+            us->result = cqe->res;
+        }
+        if(more)
+        {
+            return 0;
+        }
+        uring_send_done(ul, fd, ev);
+        return 1;
+    }
+
+    if(kind == UD_CANCEL)
+    {
+        return 0;
+    }
+
+    // Completion for an fd that has been removed since this was armed
+    if(UD_GEN(ud) != (ul->gen[fd] & 0xFFFFFF))
+    {
+        if(cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            uring_return_buf(ul, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return 0;
+    }
+
+    ev->fd = fd;
+    ev->data = NULL;
+    ev->buf_id = -1;
+
+    switch(kind)
+    {
+        case UD_ACCEPT:
+            if(!more && uring_prep_accept(ul, fd) == -1)
+            {
+                fprintf(stderr, "io_uring: out of memory, no longer accepting on fd %d\n", fd);
+            }
+            ev->type = EVENT_ACCEPT;
+            ev->result = cqe->res;
+            return 1;
+
+        case UD_POLL:
+            if(!more && uring_prep_poll(ul, fd) == -1)
+            {
+                fprintf(stderr, "io_uring: out of memory, no longer polling fd %d\n", fd);
+            }
+            if(cqe->res < 0)
+            {
+                return 0;
+            }
+            ev->type = EVENT_READABLE;
+            ev->result = 0;
+            return 1;
+
+        case UD_RECV:
+            // Being stopped: pass on what it read, but neither re-arm it nor report how it ended
+            if(ul->stopping[fd])
+            {
+                if(!more)
+                {
+                    uring_stop_done(ul, fd);
+                }
+                if(cqe->res <= 0)
+                {
+                    return 0;
+                }
+            }
+            // Ran out of provided buffers. The data waits in the socket until the caller releases one
+            else if(cqe->res == -ENOBUFS)
+            {
+                uring_starve(ul, fd);
+                return 0;
+            }
+            else if(!more && cqe->res > 0 && uring_prep_recv(ul, fd) == -1)
+            {
+                uring_starve(ul, fd);
+            }
+
+            ev->type = EVENT_DATA;
+            ev->result = cqe->res;
+            if(cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ul->bufs_out++;
+                ev->buf_id = bid;
+                ev->data = uring_buf(ul, bid);
+                ev->data[cqe->res > 0 ? cqe->res : 0] = '\0';
+            }
+            return 1;
+    }
+    return 0;
+}
+
+// With every completion reaped, the buffers the caller does not hold are all in the ring, so as many recvs can go
+static void uring_rearm_idle_bufs(struct uring_loop *ul)
+{
+    if(ul->nstarved > 0 && ul->bufs_out < URING_BUF_COUNT)
+    {
+        uring_rearm_starved(ul, URING_BUF_COUNT - ul->bufs_out);
+    }
+}
+
+static int uring_wait(struct event_loop *loop, struct event *events, int max_events, int timeout_ms)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+    unsigned head, tail;
+    int n = 0;
+
+    head = *ul->cq_head;
+    tail = __atomic_load_n(ul->cq_tail, __ATOMIC_ACQUIRE);
+
+    if(head == tail)
+    {
+        // A buffer handed back re-arms one recv, which may sit on it with nothing to read while others have data
+        uring_rearm_idle_bufs(ul);
+
+        // Stopped reads still to be reported are events already, so do not block
+        if(uring_submit(ul, 1, ul->nstopped > 0 ? 0 : timeout_ms) == -1)
+        {
+            return -1;
+        }
+        tail = __atomic_load_n(ul->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    while(head != tail && n < max_events)
+    {
+        n += uring_handle_cqe(ul, &ul->cqes[head & *ul->cq_mask], &events[n]);
+        head++;
+    }
+    __atomic_store_n(ul->cq_head, head, __ATOMIC_RELEASE);
+
+    // After the data they read, which came out of earlier CQEs
+    while(ul->nstopped > 0 && n < max_events)
+    {
+        memset(&events[n], 0, sizeof events[n]);
+        events[n].type = EVENT_DATA;
+        events[n].fd = ul->stopped[--ul->nstopped];
+        events[n].result = -ECANCELED;
+        events[n].buf_id = -1;
+        n++;
+    }
+
+    // A recv that ran out is re-armed when the caller hands a buffer back. But the caller may have handed back all
+    // it held before the kernel's ENOBUFS was reaped
+    if(head == __atomic_load_n(ul->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        uring_rearm_idle_bufs(ul);
+    }
+
+    // Push any re-arms queued while reaping
+    uring_submit(ul, 0, -1);
+
+    return n;
+}
+
+static void uring_release(struct event_loop *loop, struct event *ev)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+
+    if(ev->buf_id >= 0)
+    {
+        ul->bufs_out--;
+        uring_return_buf(ul, ev->buf_id);
+        ev->buf_id = -1;
+        ev->data = NULL;
+    }
+}
+
+// Queue a send. It is submitted along with everything else on the next wait
+static int uring_sendmsg(struct event_loop *loop, int fd, struct msghdr *msg, void *cookie)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+    struct uring_send *us;
+    struct io_uring_sqe *sqe;
+    size_t nbytes = 0;
+    int id;
+
+    if((id = uring_alloc_send(ul)) == -1)
+    {
+        return -1;
+    }
+    if((sqe = uring_get_sqe(ul)) == NULL)
+    {
+        uring_free_send(ul, id);
+        return -1;
+    }
+
+    us = &ul->sends[id];
+    us->fd = fd;
+    us->result = 0;
+    us->cookie = cookie;
+
+    for(size_t i = 0; i < msg->msg_iovlen; ++i)
+    {
+        nbytes += msg->msg_iov[i].iov_len;
+    }
+
+    sqe->opcode = (ul->zc_send && nbytes >= URING_ZC_SEND_THRESHOLD) ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = UD_MAKE(UD_SEND, 0, id);
+    return 0;
+}
+
+static void uring_unmap_rings(struct uring_loop *ul)
+{
+    munmap(ul->sqes, ul->sqes_size);
+    if(ul->cq_ring != ul->sq_ring)
+    {
+        munmap(ul->cq_ring, ul->cq_ring_size);
+    }
+    munmap(ul->sq_ring, ul->sq_ring_size);
+}
+
+static void uring_destroy(struct event_loop *loop)
+{
+    struct uring_loop *ul = (struct uring_loop*)loop;
+
+    close(ul->ring_fd);
+    uring_unmap_rings(ul);
+    munmap(ul->buf_ring, ul->buf_ring_size);
+    free(ul->bufs);
+    free(ul->sends);
+    free(ul->backlog);
+    free(ul);
+}
+
+static const struct event_loop_ops uring_ops = {
+    "io_uring",
+    uring_add_listener,
+    uring_add_reader,
+    uring_add_client,
+    uring_remove,
+    uring_stop_reading,
+    uring_wait,
+    uring_release,
+    uring_sendmsg,
+    uring_destroy
+};
+
+static int uring_map_rings(struct uring_loop *ul, struct io_uring_params *p)
+{
+    ul->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ul->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ul->cq_ring_size > ul->sq_ring_size)
+        {
+            ul->sq_ring_size = ul->cq_ring_size;
+        }
+        ul->cq_ring_size = ul->sq_ring_size;
+    }
+
+    ul->sq_ring = mmap(NULL, ul->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ul->ring_fd, IORING_OFF_SQ_RING);
+    if(ul->sq_ring == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if(p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ul->cq_ring = ul->sq_ring;
+    }
+    else
+    {
+        ul->cq_ring = mmap(NULL, ul->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ul->ring_fd, IORING_OFF_CQ_RING);
+        if(ul->cq_ring == MAP_FAILED)
+        {
+            munmap(ul->sq_ring, ul->sq_ring_size);
+            return -1;
+        }
+    }
+
+    ul->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ul->sqes = mmap(NULL, ul->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ul->ring_fd, IORING_OFF_SQES);
+    if(ul->sqes == MAP_FAILED)
+    {
+        if(ul->cq_ring != ul->sq_ring)
+        {
+            munmap(ul->cq_ring, ul->cq_ring_size);
+        }
+        munmap(ul->sq_ring, ul->sq_ring_size);
+        return -1;
+    }
+
+    ul->sq_head = (unsigned*)((char*)ul->sq_ring + p->sq_off.head);
+    ul->sq_tail = (unsigned*)((char*)ul->sq_ring + p->sq_off.tail);
+    ul->sq_mask = (unsigned*)((char*)ul->sq_ring + p->sq_off.ring_mask);
+    ul->sq_array = (unsigned*)((char*)ul->sq_ring + p->sq_off.array);
+    ul->sq_local_tail = *ul->sq_tail;
+
+    ul->cq_head = (unsigned*)((char*)ul->cq_ring + p->cq_off.head);
+    ul->cq_tail = (unsigned*)((char*)ul->cq_ring + p->cq_off.tail);
+    ul->cq_mask = (unsigned*)((char*)ul->cq_ring + p->cq_off.ring_mask);
+    ul->cqes = (struct io_uring_cqe*)((char*)ul->cq_ring + p->cq_off.cqes);
+    return 0;
+}
+
+static int uring_setup_buffers(struct uring_loop *ul)
+{
+    struct io_uring_buf_reg reg;
+
+    ul->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ul->buf_ring = mmap(NULL, ul->buf_ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(ul->buf_ring == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)ul->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if(sys_io_uring_register(ul->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        munmap(ul->buf_ring, ul->buf_ring_size);
+        return -1;
+    }
+
+    if((ul->bufs = malloc((size_t)URING_BUF_COUNT * (EVENT_LOOP_BUF_SIZE+1))) == NULL)
+    {
+        munmap(ul->buf_ring, ul->buf_ring_size);
+        return -1;
+    }
+    ul->buf_tail = 0;
+    for(int i = 0; i < URING_BUF_COUNT; ++i)
+    {
+        uring_recycle_buf(ul, i);
+    }
+    return 0;
+}
+
+// Check which opcodes the kernel knows. Multishot accept and recv have no probe bit of their own, but they landed in
+// the same release as zero-copy send, so a kernel without SEND_ZC is treated as too old
+static int uring_probe_ops(struct uring_loop *ul)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = 0;
+
+    if(probe != NULL && sys_io_uring_register(ul->ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+       probe->ops_len > IORING_OP_SEND_ZC &&
+       (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))
+    {
+        ok = 1;
+        ul->zc_send = probe->ops_len > IORING_OP_SENDMSG_ZC && (probe->ops[IORING_OP_SENDMSG_ZC].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+struct event_loop *event_loop_create_uring()
+{
+    struct uring_loop *ul = calloc(1, sizeof *ul);
+    struct io_uring_params params;
+
+    if(ul == NULL)
+    {
+        return NULL;
+    }
+    ul->free_send = -1;
+
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    if((ul->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params)) == -1)
+    {
+        free(ul);
+        return NULL;
+    }
+
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !uring_probe_ops(ul))
+    {
+        close(ul->ring_fd);
+        free(ul);
+        return NULL;
+    }
+
+    if(uring_map_rings(ul, &params) == -1)
+    {
+        close(ul->ring_fd);
+        free(ul);
+        return NULL;
+    }
+
+    if(uring_setup_buffers(ul) == -1)
+    {
+        uring_unmap_rings(ul);
+        close(ul->ring_fd);
+        free(ul);
+        return NULL;
+    }
+
+    ul->base.ops = &uring_ops;
+    return &ul->base;
+}
@@ -0,0 +1,282 @@
+/*
+    Passing sockets from a running server to its replacement over a Unix socket.
+*/
+
+#define _GNU_SOURCE
+
+#include "handoff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int handoff_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "handoff: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// A directory only we can reach: owned by us, not a symlink, and closed to group and others
+static int handoff_private_dir(const char *dir)
+{
+    struct stat st;
+
+    if(lstat(dir, &st) == -1)
+    {
+        perror("handoff: lstat");
+        return 0;
+    }
+
+    if(!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0077) != 0)
+    {
+        fprintf(stderr, "handoff: %s is not a private directory of ours\n", dir);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Build the path of the handoff socket called name. It lives in $XDG_RUNTIME_DIR, or failing that in a
+    /tmp/chatroom-<uid> directory we create with mode 0700, so no other local user can plant or squat on it.
+*/
+int handoff_path(char *path, int size, const char *name)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char dir[256];
+
+    if(runtime != NULL && runtime[0] == '/')
+    {
+        snprintf(dir, sizeof dir, "%s", runtime);
+    }
+    else
+    {
+        snprintf(dir, sizeof dir, "/tmp/chatroom-%u", (unsigned)getuid());
+        if(mkdir(dir, 0700) == -1 && errno != EEXIST)
+        {
+            perror("handoff: mkdir");
+            return -1;
+        }
+    }
+
+    if(!handoff_private_dir(dir))
+    {
+        return -1;
+    }
+
+    if(snprintf(path, size, "%s/%s", dir, name) >= size)
+    {
+        fprintf(stderr, "handoff: socket path too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the other end of a Unix socket runs as the same user we do
+static int handoff_peer_is_us(int sockfd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    return getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+// Listen for a replacement server. Only our own user may connect, since whoever does is given every client socket
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t old_mask;
+    int sockfd;
+
+    if(handoff_address(path, &addr) == -1)
+    {
+        return -1;
+    }
+
+    if((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    {
+        perror("handoff: socket");
+        return -1;
+    }
+
+    unlink(path);
+
+    old_mask = umask(0077);
+    if(bind(sockfd, (struct sockaddr*)&addr, sizeof addr) == -1)
+    {
+        umask(old_mask);
+        perror("handoff: bind");
+        close(sockfd);
+        return -1;
+    }
+    umask(old_mask);
+
+    if(listen(sockfd, 1) == -1)
+    {
+        perror("handoff: listen");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Accept a replacement server, refusing anyone not running as the same user
+int handoff_accept(int listenfd)
+{
+    int sockfd;
+
+    if((sockfd = accept(listenfd, NULL, NULL)) == -1)
+    {
+        perror("handoff: accept");
+        return -1;
+    }
+
+    if(!handoff_peer_is_us(sockfd))
+    {
+        fprintf(stderr, "handoff: refusing connection from another user\n");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Connect to the running server, refusing to hand anything to a listener run by another user
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sockfd;
+
+    if(handoff_address(path, &addr) == -1)
+    {
+        return -1;
+    }
+
+    if((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    {
+        perror("handoff: socket");
+        return -1;
+    }
+
+    if(connect(sockfd, (struct sockaddr*)&addr, sizeof addr) == -1)
+    {
+        perror("handoff: connect");
+        close(sockfd);
+        return -1;
+    }
+
+    if(!handoff_peer_is_us(sockfd))
+    {
+        fprintf(stderr, "handoff: %s is held by another user\n", path);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Send nbytes of data, with fd attached unless it is -1
+int handoff_send(int sock, const void *data, int nbytes, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    int sent = 0, rv;
+
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = (void*)data;
+    iov.iov_len = nbytes;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(fd != -1)
+    {
+        memset(control, 0, sizeof control);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    // The descriptor goes with the first chunk; anything left over is plain data
+    while(sent < nbytes)
+    {
+        if((rv = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("handoff: sendmsg");
+            return -1;
+        }
+        sent += rv;
+        iov.iov_base = (char*)data + sent;
+        iov.iov_len = nbytes - sent;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
+
+    return 0;
+}
+
+// Receive exactly nbytes of data. *fd is set to the descriptor that came with it, or -1 if none did
+int handoff_recv(int sock, void *data, int nbytes, int *fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    int received = 0, rv;
+
+    *fd = -1;
+
+    while(received < nbytes)
+    {
+        memset(&msg, 0, sizeof msg);
+        iov.iov_base = (char*)data + received;
+        iov.iov_len = nbytes - received;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        if((rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+        {
+            if(rv == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        received += rv;
+    }
+
+    return 0;
+}
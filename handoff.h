@@ -0,0 +1,14 @@
+/*
+    Passing sockets from a running server to its replacement over a Unix socket.
+    Each record is a block of plain data with at most one file descriptor riding along with it (SCM_RIGHTS).
+*/
+
+#pragma once
+
+int handoff_path(char *path, int size, const char *name);
+int handoff_listen(const char *path);
+int handoff_accept(int listenfd);
+int handoff_connect(const char *path);
+
+int handoff_send(int sock, const void *data, int nbytes, int fd);
+int handoff_recv(int sock, void *data, int nbytes, int *fd);
@@ -0,0 +1,250 @@
+/*
+    Offline delivery for the server.
+*/
+
+#include "mailbox.h"
+#include "budget.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_HEADER 2 // Length ahead of each frame in a mailbox
+
+static struct mailbox mailboxes[MAILBOX_MAX];
+
+// Keep a copy of a chat frame sent to the room, pushing out the oldest once the ring is full
+void history_append(struct room_history *h, const char *frame, int nbytes)
+{
+    struct history_entry *e = &h->entries[h->next_seq % HISTORY_PER_ROOM];
+
+    if(e->frame != NULL)
+    {
+        budget_release(BUDGET_HISTORY, e->nbytes);
+        free(e->frame);
+    }
+
+    e->frame = malloc(nbytes);
+    memcpy(e->frame, frame, nbytes);
+    e->nbytes = nbytes;
+    e->seq = h->next_seq++;
+    budget_charge(BUDGET_HISTORY, nbytes);
+}
+
+void history_clear(struct room_history *h)
+{
+    for(int i = 0; i < HISTORY_PER_ROOM; ++i)
+    {
+        if(h->entries[i].frame != NULL)
+        {
+            budget_release(BUDGET_HISTORY, h->entries[i].nbytes);
+            free(h->entries[i].frame);
+            h->entries[i].frame = NULL;
+        }
+    }
+}
+
+/*
+    Start keeping mail for a user who has just left. If they already have a mailbox (someone else under the same name
+    left earlier) it is kept as is, cursor included.
+*/
+struct mailbox *mailbox_open(const char *username, const char *address, int room, uint64_t room_seq, long long now_ms)
+{
+    struct mailbox *m = mailbox_find(username);
+    struct mailbox *oldest = &mailboxes[0];
+
+    if(m != NULL)
+    {
+        return m;
+    }
+
+    for(int i = 0; i < MAILBOX_MAX && m == NULL; ++i)
+    {
+        if(!mailboxes[i].in_use)
+        {
+            m = &mailboxes[i];
+        }
+        else if(mailboxes[i].left_ms < oldest->left_ms)
+        {
+            oldest = &mailboxes[i];
+        }
+    }
+
+    if(m == NULL)
+    {
+        mailbox_close(oldest);
+        m = oldest;
+    }
+
+    memset(m, 0, sizeof *m);
+    m->in_use = 1;
+    strcpy(m->username, username);
+    snprintf(m->address, sizeof m->address, "%s", address);
+    m->room = room;
+    m->room_seq = room_seq;
+    m->left_ms = now_ms;
+    return m;
+}
+
+struct mailbox *mailbox_find(const char *username)
+{
+    for(int i = 0; i < MAILBOX_MAX; ++i)
+    {
+        if(mailboxes[i].in_use && strcmp(mailboxes[i].username, username) == 0)
+        {
+            return &mailboxes[i];
+        }
+    }
+    return NULL;
+}
+
+// Whether text mentions name as "@name", with the name not running on into a longer one
+static int mentions(const char *text, const char *name)
+{
+    int len = strlen(name);
+    const char *at = text;
+
+    while((at = strchr(at, '@')) != NULL)
+    {
+        at++;
+        if(strncmp(at, name, len) == 0 && !isalnum((unsigned char)at[len]) && at[len] != '_')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Fill found with the mailboxes of absent users mentioned in text. Returns how many there were
+int mailbox_find_mentions(const char *text, struct mailbox **found, int max_found)
+{
+    int n = 0;
+
+    if(strchr(text, '@') == NULL)
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < MAILBOX_MAX && n < max_found; ++i)
+    {
+        if(mailboxes[i].in_use && mailboxes[i].username[0] != '\0' && mentions(text, mailboxes[i].username))
+        {
+            found[n++] = &mailboxes[i];
+        }
+    }
+    return n;
+}
+
+// Drop the oldest frame in the mailbox
+static void drop_oldest(struct mailbox *m)
+{
+    int first = FRAME_HEADER + ((unsigned char)m->buf[0] | (unsigned char)m->buf[1] << 8);
+
+    memmove(m->buf, m->buf + first, m->len - first);
+    m->len -= first;
+    m->dropped++;
+}
+
+// Add a frame to the mailbox, dropping the oldest ones if it would go over quota
+void mailbox_deliver(struct mailbox *m, const char *frame, int nbytes)
+{
+    int need = FRAME_HEADER + nbytes;
+    int cap;
+
+    if(need > MAILBOX_QUOTA_BYTES)
+    {
+        m->dropped++;
+        return;
+    }
+
+    while(m->len + need > MAILBOX_QUOTA_BYTES)
+    {
+        drop_oldest(m);
+    }
+
+    if(m->len + need > m->cap)
+    {
+        cap = m->cap ? m->cap : 512;
+        while(cap < m->len + need)
+        {
+            cap *= 2;
+        }
+        cap = cap < MAILBOX_QUOTA_BYTES ? cap : MAILBOX_QUOTA_BYTES;
+
+        m->buf = realloc(m->buf, cap);
+        budget_charge(BUDGET_HISTORY, cap - m->cap);
+        m->cap = cap;
+    }
+
+    m->buf[m->len] = nbytes & 0xFF;
+    m->buf[m->len + 1] = nbytes >> 8;
+    memcpy(m->buf + m->len + FRAME_HEADER, frame, nbytes);
+    m->len += need;
+}
+
+/*
+    Gather what the owner missed into one buffer to send as a single batch: the frames of their room's history from
+    their cursor on, then their mail in the order it came. lost is set to how many messages fell out of the history
+    ring or the quota before they got back. Returns a buffer for the caller to free, NULL if there is nothing at all.
+*/
+char *mailbox_collect(struct mailbox *m, struct room_history *h, int *nbytes, int *lost)
+{
+    uint64_t first = m->room_seq;
+    char *out, *p;
+    int total = 0;
+    int pos, len;
+
+    *lost = m->dropped;
+    if(h->next_seq - first > HISTORY_PER_ROOM)
+    {
+        *lost += h->next_seq - first - HISTORY_PER_ROOM;
+        first = h->next_seq - HISTORY_PER_ROOM;
+    }
+
+    for(uint64_t seq = first; seq < h->next_seq; ++seq)
+    {
+        total += h->entries[seq % HISTORY_PER_ROOM].nbytes;
+    }
+    total += m->len;
+
+    if(total == 0)
+    {
+        *nbytes = 0;
+        return NULL;
+    }
+
+    // The length headers are never more than the frames they are stripped from
+    out = p = malloc(total);
+    for(uint64_t seq = first; seq < h->next_seq; ++seq)
+    {
+        memcpy(p, h->entries[seq % HISTORY_PER_ROOM].frame, h->entries[seq % HISTORY_PER_ROOM].nbytes);
+        p += h->entries[seq % HISTORY_PER_ROOM].nbytes;
+    }
+    for(pos = 0; pos < m->len; pos += FRAME_HEADER + len)
+    {
+        len = (unsigned char)m->buf[pos] | (unsigned char)m->buf[pos + 1] << 8;
+        memcpy(p, m->buf + pos + FRAME_HEADER, len);
+        p += len;
+    }
+
+    *nbytes = p - out;
+    return out;
+}
+
+void mailbox_close(struct mailbox *m)
+{
+    budget_release(BUDGET_HISTORY, m->cap);
+    free(m->buf);
+    memset(m, 0, sizeof *m);
+}
+
+int mailbox_count()
+{
+    int n = 0;
+
+    for(int i = 0; i < MAILBOX_MAX; ++i)
+    {
+        n += mailboxes[i].in_use;
+    }
+    return n;
+}
@@ -0,0 +1,59 @@
+/*
+    Offline delivery for the server.
+    Each room keeps its last few chat frames, numbered in order. When a user leaves, a mailbox is kept under their
+    name with how far they had got in their room's history, and direct messages and mentions sent while they are away
+    are appended to it. When they log back in, everything they missed is gathered into one buffer and sent as a single
+    batch. Mailboxes have a fixed quota and there is a fixed number of them, so an absent user who is popular only
+    costs so much. Only the main thread uses these.
+*/
+
+#pragma once
+
+#include "session.h"
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define HISTORY_PER_ROOM 32
+#define MAILBOX_QUOTA_BYTES 4096 // Most one mailbox holds; its oldest messages are dropped to make room
+#define MAILBOX_MAX 64           // Mailboxes kept at once; past this the one whose owner left longest ago is reused
+
+struct history_entry
+{
+    uint64_t seq;
+    char *frame;
+    int nbytes;
+};
+
+struct room_history
+{
+    struct history_entry entries[HISTORY_PER_ROOM]; // Ring, entry seq is at seq % HISTORY_PER_ROOM
+    uint64_t next_seq;
+};
+
+struct mailbox
+{
+    int in_use;
+    char username[MAX_USERNAME_LENGTH];
+    char address[INET6_ADDRSTRLEN]; // Where its owner connected from. Names are not authenticated, so only a login from
+                                    // there may collect it or use the name while it is kept
+    int room;
+    uint64_t room_seq; // First frame of the room's history they have not seen
+    long long left_ms;
+
+    // Frames waiting for them, each behind a 2-byte length
+    char *buf;
+    int len;
+    int cap;
+    int dropped; // Messages lost to the quota
+};
+
+void history_append(struct room_history *h, const char *frame, int nbytes);
+void history_clear(struct room_history *h);
+
+struct mailbox *mailbox_open(const char *username, const char *address, int room, uint64_t room_seq, long long now_ms);
+struct mailbox *mailbox_find(const char *username);
+int mailbox_find_mentions(const char *text, struct mailbox **found, int max_found);
+void mailbox_deliver(struct mailbox *m, const char *frame, int nbytes);
+char *mailbox_collect(struct mailbox *m, struct room_history *h, int *nbytes, int *lost);
+void mailbox_close(struct mailbox *m);
+int mailbox_count();
@@ -4,14 +4,35 @@
 
 #pragma once
 
-
-// Server-wide user joining message
-// The input strings should be: <color> <username> <color reset>
-static const char user_join_notice[] = "%s%s%s has joined.\n";
-
-// Server-wide user leaving message
-// The input strings should be: <color> <username> <color reset>
-static char user_leave_notice[] = "%s%s%s has left.\n";
+#include "colors.h"
+#include "protocol.h"
+
+// Server-wide notices about a user, each shown after the user's colored name
+// X(id, text after the name)
+#define USER_NOTICE_TABLE(X) \
+    X(NOTICE_JOINED, " has joined.\n") \
+    X(NOTICE_LEFT,   " has left.\n") \
+    X(NOTICE_KICKED, " was kicked by the server.\n")
+
+enum user_notice
+{
+#define USER_NOTICE_ENUM(id, text) id,
+    USER_NOTICE_TABLE(USER_NOTICE_ENUM)
+#undef USER_NOTICE_ENUM
+    USER_NOTICE_COUNT
+};
+
+struct notice_text
+{
+    const char *text;
+    int nbytes; // Without a terminator
+};
+
+static const struct notice_text user_notices[USER_NOTICE_COUNT] = {
+#define USER_NOTICE_ENTRY(id, text) {text, sizeof(text) - 1},
+    USER_NOTICE_TABLE(USER_NOTICE_ENTRY)
+#undef USER_NOTICE_ENTRY
+};
 
 /*
     Notices for adding a client.
@@ -19,16 +40,17 @@ static char user_leave_notice[] = "%s%s%s has left.\n";
 static const char server_is_full_notice[] = "Sorry, the server is currently full.";
 static const int server_is_full_notice_nbytes = sizeof(server_is_full_notice);
 
+static const char server_is_busy_notice[] = "Sorry, the server is too busy to take you right now.";
+
+// Sent as a server message straight after the join, before the connection is closed
+static const char name_taken_notice[] = "That username belongs to someone who is online or away. Reconnect and pick another one.\n";
+
 static const char name_request_msg[] = "Enter desired username:";
 static const int name_request_msg_nbytes = sizeof(name_request_msg);
 
-static const char color_request_msg[] = "Welcome, %s! Choose a display color. Your options are "
-                                        "\x1B[32mGREEN\x1B[0m, "
-                                        "\x1B[33mYELLOW\x1B[0m, "
-                                        "\x1B[34mBLUE\x1B[0m, "
-                                        "\x1B[35mMAGENTA\x1B[0m, "
-                                        "\x1B[36mCYAN\x1B[0m, "
-                                        "\x1B[37mWHITE\x1B[0m: ";
+// Asking for a color: the prefix, the username, then the suffix, which lists every color users may pick
+static const char color_request_prefix[] = COLOR_PROMPT_NAME_PREFIX;
+static const char color_request_suffix[] = COLOR_PROMPT_NAME_SUFFIX " Your options are" COLOR_PROMPT_OPTIONS ": ";
 
 static const char server_join_msg[] = "You have joined the server.";
 static const int server_join_msg_nbytes = sizeof(server_join_msg);
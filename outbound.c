@@ -0,0 +1,272 @@
+/*
+    Per-client outbound queues.
+*/
+
+#include "outbound.h"
+#include "budget.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Wrap data in a frame holding one reference, which belongs to the caller
+struct outmsg *outmsg_create(const char *data, int nbytes)
+{
+    struct outmsg *m = malloc(sizeof *m + nbytes);
+
+    m->refs = 1;
+    m->nbytes = nbytes;
+    m->trace_id = 0;
+    memcpy(m->data, data, nbytes);
+    budget_charge(BUDGET_OUTBOUND, sizeof *m + nbytes);
+    return m;
+}
+
+void outmsg_release(struct outmsg *m)
+{
+    if(--m->refs == 0)
+    {
+        budget_release(BUDGET_OUTBOUND, sizeof *m + m->nbytes);
+        free(m);
+    }
+}
+
+static void lane_init(struct outlane *l, struct outmsg **ring, int cap)
+{
+    l->ring = ring;
+    l->cap = cap;
+    l->head = 0;
+    l->count = 0;
+    l->nbytes = 0;
+}
+
+static void lane_push(struct outlane *l, struct outmsg *m)
+{
+    l->ring[(l->head + l->count) % l->cap] = m;
+    l->count++;
+    l->nbytes += m->nbytes;
+}
+
+static struct outmsg *lane_pop(struct outlane *l)
+{
+    struct outmsg *m;
+
+    if(l->count == 0)
+    {
+        return NULL;
+    }
+
+    m = l->ring[l->head];
+    l->head = (l->head + 1) % l->cap;
+    l->count--;
+    l->nbytes -= m->nbytes;
+    return m;
+}
+
+static void lane_clear(struct outlane *l)
+{
+    struct outmsg *m;
+
+    while((m = lane_pop(l)) != NULL)
+    {
+        outmsg_release(m);
+    }
+}
+
+struct outbound *outbound_create(int fd)
+{
+    struct outbound *o = calloc(1, sizeof *o);
+
+    o->fd = fd;
+    lane_init(&o->lanes[LANE_CONTROL], o->control_ring, OUTBOUND_CONTROL_QUEUE_LEN);
+    lane_init(&o->lanes[LANE_CHAT], o->chat_ring, OUTBOUND_CHAT_QUEUE_LEN);
+    budget_charge(BUDGET_CONNECTIONS, sizeof *o);
+    return o;
+}
+
+// Drop everything queued, including frames that were being sent
+static void outbound_clear(struct outbound *o)
+{
+    for(int lane = 0; lane < OUTBOUND_LANES; ++lane)
+    {
+        lane_clear(&o->lanes[lane]);
+    }
+    for(int i = 0; i < o->nsending; ++i)
+    {
+        outmsg_release(o->sending[i]);
+    }
+    o->nsending = 0;
+    o->sending_offset = 0;
+}
+
+// The client is gone. If the event loop is still sending from our buffers, wait for it to finish before freeing
+void outbound_destroy(struct outbound *o)
+{
+    if(o->in_flight)
+    {
+        o->closed = 1;
+        for(int lane = 0; lane < OUTBOUND_LANES; ++lane)
+        {
+            lane_clear(&o->lanes[lane]);
+        }
+        return;
+    }
+
+    outbound_clear(o);
+    budget_release(BUDGET_CONNECTIONS, sizeof *o);
+    free(o);
+}
+
+/*
+    Queue a frame, taking a reference to it. Chat sheds its oldest frames to make room, so a slow reader only ever
+    holds OUTBOUND_CHAT_LIMIT_BYTES of chat. A full control lane means the client has stopped reading entirely, so the
+    frame is dropped and -1 returned.
+*/
+int outbound_push(struct outbound *o, enum outbound_lane lane, struct outmsg *m)
+{
+    struct outlane *l = &o->lanes[lane];
+
+    if(o->broken || o->closed)
+    {
+        return -1;
+    }
+
+    if(lane == LANE_CHAT)
+    {
+        while(l->count > 0 && (l->count == l->cap || l->nbytes + m->nbytes > OUTBOUND_CHAT_LIMIT_BYTES))
+        {
+            outmsg_release(lane_pop(l));
+            o->chat_shed++;
+        }
+    }
+    else if(l->count == l->cap)
+    {
+        o->control_dropped++;
+        return -1;
+    }
+
+    m->refs++;
+    lane_push(l, m);
+    return 0;
+}
+
+// Shed the oldest chat until no more than keep_bytes of it is waiting. Returns how many frames went
+int outbound_shed_chat(struct outbound *o, int keep_bytes)
+{
+    struct outlane *l = &o->lanes[LANE_CHAT];
+    int shed = 0;
+
+    while(l->count > 0 && l->nbytes > keep_bytes)
+    {
+        outmsg_release(lane_pop(l));
+        o->chat_shed++;
+        shed++;
+    }
+    return shed;
+}
+
+/*
+    If nothing is in flight, gather queued frames into one send, control lane first.
+    Frames left over from a short send go ahead of everything else so no frame is ever split by another.
+*/
+void outbound_flush(struct outbound *o, struct event_loop *loop)
+{
+    struct outmsg *m;
+
+    if(o->in_flight || o->broken || o->closed)
+    {
+        return;
+    }
+
+    while(o->nsending < OUTBOUND_MAX_IOV)
+    {
+        if((m = lane_pop(&o->lanes[LANE_CONTROL])) == NULL && (m = lane_pop(&o->lanes[LANE_CHAT])) == NULL)
+        {
+            break;
+        }
+        o->sending[o->nsending++] = m;
+    }
+
+    if(o->nsending == 0)
+    {
+        return;
+    }
+
+    for(int i = 0; i < o->nsending; ++i)
+    {
+        o->iov[i].iov_base = o->sending[i]->data;
+        o->iov[i].iov_len = o->sending[i]->nbytes;
+    }
+    o->iov[0].iov_base = (char*)o->iov[0].iov_base + o->sending_offset;
+    o->iov[0].iov_len -= o->sending_offset;
+
+    memset(&o->msg, 0, sizeof o->msg);
+    o->msg.msg_iov = o->iov;
+    o->msg.msg_iovlen = o->nsending;
+
+    // A send the loop could not take will not complete either, so treat it like one that failed
+    o->in_flight = 1;
+    if(event_loop_sendmsg(loop, o->fd, &o->msg, o) == -1)
+    {
+        o->in_flight = 0;
+        o->broken = 1;
+        outbound_clear(o);
+    }
+}
+
+// The event loop finished a send for this queue (EVENT_SENT). Let go of what went out and send the rest
+void outbound_sent(struct outbound *o, struct event_loop *loop, int result)
+{
+    int consumed, done = 0;
+
+    o->in_flight = 0;
+
+    if(o->closed)
+    {
+        outbound_clear(o);
+        budget_release(BUDGET_CONNECTIONS, sizeof *o);
+        free(o);
+        return;
+    }
+
+    if(result < 0)
+    {
+        o->broken = 1;
+        outbound_clear(o);
+        return;
+    }
+
+    consumed = o->sending_offset + result;
+    while(done < o->nsending && consumed >= o->sending[done]->nbytes)
+    {
+        consumed -= o->sending[done]->nbytes;
+        if(o->sending[done]->trace_id != 0)
+        {
+            trace_span(o->sending[done]->trace_id, "flush", o->sending[done]->trace_ns, trace_now_ns(), o->fd);
+        }
+        outmsg_release(o->sending[done]);
+        done++;
+    }
+
+    o->nsending -= done;
+    memmove(o->sending, o->sending + done, o->nsending * sizeof(struct outmsg*));
+    o->sending_offset = o->nsending > 0 ? consumed : 0;
+
+    outbound_flush(o, loop);
+}
+
+int outbound_queued_bytes(struct outbound *o)
+{
+    int nbytes = o->lanes[LANE_CONTROL].nbytes + o->lanes[LANE_CHAT].nbytes - o->sending_offset;
+
+    for(int i = 0; i < o->nsending; ++i)
+    {
+        nbytes += o->sending[i]->nbytes;
+    }
+    return nbytes;
+}
+
+// Whether everything queued has been sent, so the stream ends on a frame boundary
+int outbound_idle(struct outbound *o)
+{
+    return !o->in_flight && outbound_queued_bytes(o) == 0;
+}
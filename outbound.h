@@ -0,0 +1,77 @@
+/*
+    Per-client outbound queues.
+    Each client has a control lane (server notices, joins and leaves, command replies, presence) and a chat lane.
+    Control frames always go out first, and when a slow reader lets its chat lane reach its limit the oldest chat is
+    shed, so operator messages still arrive promptly during a flood.
+*/
+
+#pragma once
+
+#include "event_loop.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define OUTBOUND_CONTROL_QUEUE_LEN 64
+#define OUTBOUND_CHAT_QUEUE_LEN 256
+#define OUTBOUND_CHAT_LIMIT_BYTES 32768 // Chat queued past this is shed, oldest first
+#define OUTBOUND_MAX_IOV 16 // Most frames gathered into one send
+
+enum outbound_lane
+{
+    LANE_CONTROL,
+    LANE_CHAT,
+    OUTBOUND_LANES
+};
+
+// A frame shared by every queue it was pushed to. Freed when the last reference goes
+struct outmsg
+{
+    int refs;
+    int nbytes;
+    uint32_t trace_id; // Traced message this frame carries, 0 if none
+    long long trace_ns; // When it was queued, for tracing
+    char data[];
+};
+
+struct outlane
+{
+    struct outmsg **ring;
+    int cap;
+    int head;
+    int count;
+    int nbytes;
+};
+
+struct outbound
+{
+    int fd;
+    struct outlane lanes[OUTBOUND_LANES];
+    struct outmsg *control_ring[OUTBOUND_CONTROL_QUEUE_LEN];
+    struct outmsg *chat_ring[OUTBOUND_CHAT_QUEUE_LEN];
+
+    // Frames handed to the event loop. The first may already be partly sent
+    struct outmsg *sending[OUTBOUND_MAX_IOV];
+    int nsending;
+    int sending_offset;
+    int in_flight;
+    struct msghdr msg;
+    struct iovec iov[OUTBOUND_MAX_IOV];
+
+    int broken; // A send failed; nothing more will be sent
+    int closed; // The owner is gone; freed when the send in flight completes
+
+    unsigned long chat_shed;
+    unsigned long control_dropped;
+};
+
+struct outmsg *outmsg_create(const char *data, int nbytes);
+void outmsg_release(struct outmsg *m);
+
+struct outbound *outbound_create(int fd);
+void outbound_destroy(struct outbound *o);
+int outbound_push(struct outbound *o, enum outbound_lane lane, struct outmsg *m);
+int outbound_shed_chat(struct outbound *o, int keep_bytes);
+void outbound_flush(struct outbound *o, struct event_loop *loop);
+void outbound_sent(struct outbound *o, struct event_loop *loop, int result);
+int outbound_queued_bytes(struct outbound *o);
+int outbound_idle(struct outbound *o);
@@ -0,0 +1,65 @@
+/*
+    Commands and frame markers shared by the server and clients.
+*/
+
+#pragma once
+
+// A chat line starting with this is a command for the server rather than a message for the room
+#define COMMAND_PREFIX '/'
+
+// Client commands
+#define WHO_COMMAND "/who"       // List everyone on the server
+#define TYPING_COMMAND "/typing" // The sender is typing; repeat at least every TYPING_TIMEOUT_MS to stay marked
+#define JOIN_COMMAND "/join"     // Move to another room: "/join 3"
+#define SUBSCRIBE_COMMAND "/subscribe"     // Also hear a topic, e.g. another room's feed: "/subscribe room3"
+#define UNSUBSCRIBE_COMMAND "/unsubscribe" // Stop hearing a topic, including your own room or announcements
+#define TOPICS_COMMAND "/topics" // List the topics and which ones the sender hears
+#define MSG_COMMAND "/msg"       // Direct message, kept for them if they are away: "/msg alice hello"
+
+// The client commands as opcodes for the server to dispatch on, with their lengths worked out at compile time
+// X(opcode, command)
+#define CLIENT_COMMAND_TABLE(X) \
+    X(CMD_WHO, WHO_COMMAND) \
+    X(CMD_TYPING, TYPING_COMMAND) \
+    X(CMD_JOIN, JOIN_COMMAND) \
+    X(CMD_SUBSCRIBE, SUBSCRIBE_COMMAND) \
+    X(CMD_UNSUBSCRIBE, UNSUBSCRIBE_COMMAND) \
+    X(CMD_TOPICS, TOPICS_COMMAND) \
+    X(CMD_MSG, MSG_COMMAND)
+
+enum client_command
+{
+#define CLIENT_COMMAND_ENUM(opcode, command) opcode,
+    CLIENT_COMMAND_TABLE(CLIENT_COMMAND_ENUM)
+#undef CLIENT_COMMAND_ENUM
+    CMD_UNKNOWN
+};
+
+static const struct
+{
+    const char *text;
+    int nbytes;
+} client_commands[CMD_UNKNOWN] = {
+#define CLIENT_COMMAND_ENTRY(opcode, command) {command, sizeof(command) - 1},
+    CLIENT_COMMAND_TABLE(CLIENT_COMMAND_ENTRY)
+#undef CLIENT_COMMAND_ENTRY
+};
+
+#define TYPING_TIMEOUT_MS 3000
+
+// A line starting with this byte is a presence frame rather than chat: a comma separated list of who in the room is
+// typing. An empty list means nobody is. Usernames may not contain the separator
+#define PRESENCE_FRAME_MARKER '\x11'
+#define PRESENCE_NAME_SEPARATOR ","
+
+// The color prompt repeats the username as the server will show it, between these two:
+// "Welcome, alice! Choose a display color. Your options are..."
+#define COLOR_PROMPT_NAME_PREFIX "Welcome, "
+#define COLOR_PROMPT_NAME_SUFFIX "! Choose a display color."
+
+// A refused login's notice ends with this hint, e.g. "Sorry, the server is currently full. Try again in 30 seconds."
+#define RETRY_AFTER_HINT "Try again in %d seconds."
+
+// Sent in place of the color prompt when the username is blank once cleaned or holds the presence separator, and the
+// login ends there
+#define INVALID_USERNAME_NOTICE "That username cannot be used: it must have something to show and no commas. Pick another one."
@@ -0,0 +1,258 @@
+/*
+    Replays captured client byte streams through the server's protocol code (session.c), with no sockets or threads.
+    Each file holds everything one client sent, from the start of its login onwards. Every file is replayed the given
+    number of times, split into reads of a fixed size, and the parser's throughput is reported. The counts it prints
+    depend only on the input, whatever the read size, so two runs over the same captures can be compared directly.
+    With -c it checks that instead: each capture is replayed at every read size up to REPLAY_READ_SIZE and the counts
+    are compared with reading it whole.
+
+    Built with -DFUZZING it instead provides the libFuzzer entry point, where the first byte of each input picks the
+    read size and a difference from reading the input whole is reported as a crash.
+*/
+
+#define _GNU_SOURCE
+
+#include "session.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_READ_SIZE 512 // Same as the server's recv buffer
+
+struct replay_counts
+{
+    unsigned long logins;
+    unsigned long failed_logins;
+    unsigned long reply_bytes;
+    unsigned long messages;
+    unsigned long commands;
+    unsigned long blank; // Nothing left after sanitizing, so the server would drop them
+    unsigned long message_bytes;
+};
+
+static void count_message(void *ctx, char *msg, int nbytes)
+{
+    struct replay_counts *counts = ctx;
+
+    counts->messages++;
+    if((nbytes = message_sanitize(msg, nbytes)) == -1)
+    {
+        counts->blank++;
+        return;
+    }
+    counts->message_bytes += nbytes;
+    if(msg[0] == COMMAND_PREFIX)
+    {
+        counts->commands++;
+    }
+}
+
+// Feed one client's stream through the login and then the message reader, read_size bytes at a time like the server
+static void replay_stream(const char *data, int nbytes, int read_size, struct replay_counts *counts)
+{
+    struct login login;
+    struct message_reader reader;
+    int pos = 0, used = 0, n = 0;
+
+    login_start(&login);
+    while(login.state != LOGIN_DONE && login.state != LOGIN_FAILED)
+    {
+        if(used == n)
+        {
+            if(pos == nbytes)
+            {
+                break;
+            }
+            data += n;
+            n = nbytes - pos < read_size ? nbytes - pos : read_size;
+            pos += n;
+            used = 0;
+        }
+        used += login_feed(&login, data + used, n - used);
+        counts->reply_bytes += login.out_len;
+    }
+
+    if(login.state != LOGIN_DONE)
+    {
+        counts->failed_logins++;
+        return;
+    }
+    counts->logins++;
+
+    // The rest of the read that carried the last login answer goes to the reader first, as the server does
+    message_reader_init(&reader);
+    message_reader_feed(&reader, data + used, n - used, count_message, counts);
+    data += n;
+    while(pos < nbytes)
+    {
+        n = nbytes - pos < read_size ? nbytes - pos : read_size;
+        message_reader_feed(&reader, data, n, count_message, counts);
+        data += n;
+        pos += n;
+    }
+}
+
+// Whether splitting a stream into read_size reads changes any count compared with reading it all at once
+static int split_changes_counts(const char *data, int nbytes, int read_size)
+{
+    struct replay_counts whole, split;
+
+    memset(&whole, 0, sizeof whole);
+    memset(&split, 0, sizeof split);
+    replay_stream(data, nbytes, nbytes > 0 ? nbytes : 1, &whole);
+    replay_stream(data, nbytes, read_size, &split);
+    return memcmp(&whole, &split, sizeof whole) != 0;
+}
+
+#ifdef FUZZING
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(size == 0)
+    {
+        return 0;
+    }
+
+    if(split_changes_counts((const char*)data + 1, size - 1, data[0] + 1))
+    {
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+static char *read_file(const char *path, int *nbytes)
+{
+    FILE *f = fopen(path, "rb");
+    char *data;
+    long size;
+
+    if(f == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(size > 0 ? size : 1);
+    if(fread(data, 1, size, f) != (size_t)size)
+    {
+        perror(path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *nbytes = size;
+    return data;
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_counts counts;
+    char **streams;
+    int *stream_nbytes;
+    int nstreams = 0;
+    int iterations = 1;
+    int read_size = REPLAY_READ_SIZE;
+    int check = 0;
+    double total_bytes = 0, start, elapsed;
+    int opt;
+
+    while((opt = getopt(argc, argv, "cn:r:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                check = 1;
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'r':
+                read_size = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: replay [-c] [-n iterations] [-r read size] capture...\n");
+                exit(1);
+        }
+    }
+
+    if(optind == argc || iterations < 1 || read_size < 1)
+    {
+        fprintf(stderr, "usage: replay [-c] [-n iterations] [-r read size] capture...\n");
+        exit(1);
+    }
+
+    streams = malloc((argc - optind) * sizeof(char*));
+    stream_nbytes = malloc((argc - optind) * sizeof(int));
+    for(int i = optind; i < argc; ++i)
+    {
+        if((streams[nstreams] = read_file(argv[i], &stream_nbytes[nstreams])) == NULL)
+        {
+            exit(2);
+        }
+        total_bytes += stream_nbytes[nstreams];
+        nstreams++;
+    }
+
+    if(check)
+    {
+        for(int i = 0; i < nstreams; ++i)
+        {
+            for(int size = 1; size <= REPLAY_READ_SIZE; ++size)
+            {
+                if(split_changes_counts(streams[i], stream_nbytes[i], size))
+                {
+                    printf("%s: counts differ with %d-byte reads\n", argv[optind + i], size);
+                    exit(3);
+                }
+            }
+        }
+        printf("%d streams give the same counts at every read size up to %d\n", nstreams, REPLAY_READ_SIZE);
+        exit(0);
+    }
+
+    memset(&counts, 0, sizeof counts);
+    start = now_seconds();
+    for(int it = 0; it < iterations; ++it)
+    {
+        for(int i = 0; i < nstreams; ++i)
+        {
+            replay_stream(streams[i], stream_nbytes[i], read_size, &counts);
+        }
+    }
+    elapsed = now_seconds() - start;
+
+    // Counts are per pass, so they match whatever the iteration count
+    printf("%d streams, %.0f bytes, %d-byte reads\n", nstreams, total_bytes, read_size);
+    printf("logins %lu, failed %lu, reply bytes %lu\n", counts.logins / iterations, counts.failed_logins / iterations, counts.reply_bytes / iterations);
+    printf("messages %lu (%lu commands, %lu blank), message bytes %lu\n", counts.messages / iterations, counts.commands / iterations, counts.blank / iterations, counts.message_bytes / iterations);
+    printf("%d passes in %.3f s: %.1f MB/s, %.0f messages/s\n", iterations, elapsed, total_bytes * iterations / elapsed / 1e6, counts.messages / elapsed);
+
+    for(int i = 0; i < nstreams; ++i)
+    {
+        free(streams[i]);
+    }
+    free(streams);
+    free(stream_nbytes);
+    return 0;
+}
+
+#endif
@@ -6,6 +6,15 @@
 
 #include "terminal.h"
 #include "notices.h"
+#include "event_loop.h"
+#include "handoff.h"
+#include "outbound.h"
+#include "protocol.h"
+#include "session.h"
+#include "topic.h"
+#include "budget.h"
+#include "mailbox.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,6 +22,10 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -27,44 +40,158 @@
 #define BACKLOG 10
 #define MAXDATASIZE 512
 #define MAXCONNECTIONS 10
-#define MAX_USERNAME_LENGTH 20
-
-#define SERVER_TERMINAL_COLOR terminal_colors[1] // Color of the server's name when sending messages
+#define MAXROOMS 16
+#define PRESENCE_INTERVAL_MS 250 // Typing changes are batched into at most one presence frame per room this often
+#define RATE_LIMIT_WINDOW_MS 1000 // Default window for /ratelimit
+
+// Admission control. Past any of these limits newcomers are turned away at once with a hint of when to retry
+#define MAX_PENDING_LOGINS 8
+#define LOGIN_TIMEOUT_S 30 // Whole handshake, so a client that stalls cannot hold a login slot for long
+#define ADMISSION_BUDGET_PERCENT 75 // Share of the memory budget in use past which newcomers are refused
+#define OUTBOUND_BUDGET_FLOOR_PERCENT 25 // Share of the memory budget queued output may use however much the rest holds
+#define ADMISSION_LAG_LIMIT_MS 100
+#define FULL_RETRY_AFTER_S 30
+#define BUSY_RETRY_AFTER_S 5
+
+#define HANDOFF_NAME "chatroom-" PORT ".handoff" // Where a replacement server asks for our sockets, inside our private runtime directory
+#define HANDOFF_MAGIC 0x43485434 // "CHT4", bumped whenever struct handoff_user changes
+#define HANDOFF_DRAIN_MS 5000 // Longest a handoff waits for clients' queued output to go out
+#define HANDOFF_HELD_INPUT 16384 // Most a client may send while its output drains and still be handed off
+#define HANDOFF_STOP_MS 1000 // Longest a handoff waits for the loop to hand over what it already read from clients
+
+#define LOGIN_THREAD_STACK_SIZE (64 * 1024) // Logins need little stack, and it counts against the memory budget
+#define CLIENT_SNDBUF_BYTES (64 * 1024) // Caps the kernel's buffering per client, so a slow reader backs up into the budgeted queues
+#define BUSY_NOTICE_INTERVAL_MS 1000 // How often a user is told their chat is being refused while over budget
+#define MUTE_NOTICE_INTERVAL_MS 10000 // How often a muted user who keeps chatting is reminded that nobody hears them
+
+#define SERVER_TERMINAL_COLOR colors[COLOR_SERVER_NAME].escape // Color of the server's name when sending messages
 
 struct user
 {
     int sockfd;
+    int slot; // Index in userlist, and the user's bit in every topic
     char username[MAX_USERNAME_LENGTH];
+    char address[INET6_ADDRSTRLEN]; // Where they connected from, which ties their mailbox to them once they leave
     int text_color;
+    int room; // Where their chat goes and who sees them typing. They hear every room feed they subscribe to
+    long long typing_until_ms; // When their typing indicator lapses, 0 if they are not typing
+    long long muted_until_ms; // 0 if they may chat, MUTED_FOREVER until an operator unmutes them
+    long long rate_window_start_ms;
+    int rate_window_msgs; // Chat messages sent since rate_window_start_ms
+    long long busy_notice_ms; // When they were last told their chat was refused for lack of memory
+    long long mute_notice_ms; // When they were last told they are muted
+    struct outbound *out;
+    struct message_reader reader;
+
+    // What they sent while a handoff was draining, passed on unread, or what the old server passed on that way.
+    // held_len is -1 if it overflowed
+    char *held;
+    int held_len;
+};
+
+#define MUTED_FOREVER 0x7FFFFFFFFFFFFFFFLL
+
+// How much the server reports on its own terminal. Chat itself is always shown
+enum log_level
+{
+    LOG_ERROR,
+    LOG_INFO,  // Connections, joins and leaves
+    LOG_DEBUG  // Also client commands and every message that is dropped
+};
+
+static const char *log_level_names[] = {"error", "info", "debug"};
+
+// What a replacement server is told about us, followed by one handoff_user per logged-in client
+struct handoff_header
+{
+    uint32_t magic;
+    uint32_t num_users;
+};
+
+// A logged-in client as passed to a replacement server. The client's socket rides along with it
+struct handoff_user
+{
+    char username[MAX_USERNAME_LENGTH];
+    int32_t text_color;
+    int32_t room;
+    int64_t muted_until_ms; // CLOCK_MONOTONIC is shared by both processes, so this carries over as is
+    uint64_t topics; // Bit n set if subscribed to topic n. Both servers create the same topics in the same order
+
+    // A message the client had started sending, so the replacement carries on reading it from the right place
+    int32_t reader_len;
+    int32_t reader_discarding;
+    char reader_buf[SESSION_MAX_MESSAGE];
+
+    // Sent while the old server was draining, for the replacement to read first
+    int32_t held_len;
+    char held[HANDOFF_HELD_INPUT];
 };
 
 struct thread_info
 {
     int client_fd;
     int wakeup_pipe_fd;
-    fd_set *master;
 };
 
 char terminal_buf[MAXDATASIZE];
 int terminal_buf_len;
 
-static int pipefd[2]; // This pipe will be used as a self-pipe to wake up select()
+static int pipefd[2]; // Self-pipe that login threads use to hand finished users to the main thread
+
+struct event_loop *loop;
+
+int server_sockfd;
+char handoff_socket_path[108];
+int handoff_sockfd = -1; // -1 when handoff is unavailable and the server simply runs without it
+int handoff_conn = -1; // A replacement server waiting for our sockets
+int handing_off; // Draining output for a handoff; what clients send now is held for the replacement
 
 struct user *userlist[MAXCONNECTIONS];
 int num_users;
 
+// Who hears what. Every room has a feed, and console broadcasts go out on announcements
+struct topics *topics;
+int room_topics[MAXROOMS];
+struct room_history room_history[MAXROOMS]; // Recent chat in each room, for users who left it
+int announcements_topic;
+
+// Typing state waiting to go out in the next presence frames
+int room_presence_changed[MAXROOMS];
+int presence_changed;
+int num_typing;
+long long next_presence_tick_ms;
+
+// Operator settings, changed from the console
+enum log_level log_level = LOG_INFO;
+int rate_limit_msgs; // Most chat messages a user may send per rate_limit_window_ms, 0 for no limit
+int rate_limit_window_ms = RATE_LIMIT_WINDOW_MS;
+int draining; // New connections are refused while set
+
+// Load seen at accept time
+int pending_logins; // Login threads still running
+int listening = 1; // Whether the listening socket is in the event loop
+long long loop_lag_ms; // Smoothed time spent handling each batch of events, i.e. how long an event can wait its turn
+
+// Totals for /stats
+unsigned long msgs_relayed;
+unsigned long msgs_rate_limited;
+unsigned long msgs_muted;
+unsigned long connections_refused;
+unsigned long chat_evicted;
+unsigned long msgs_over_budget;
+
+// The sampled message being handled right now, if any, and when the read that brought it in was handed over
+uint32_t trace_current;
+long long trace_received_ns;
+
 pthread_mutex_t userlist_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t self_terminal_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t master_fd_set_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Convert all characters in string to lower-case for normalization
-void strToLower(char *buf)
+long long now_ms()
 {
-    int len = strlen(buf);
-    for(int i = 0; i < len; ++i)
-    {
-        buf[i] = tolower(buf[i]);
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 void initialize_userlist()
@@ -75,6 +202,20 @@ void initialize_userlist()
     }
 }
 
+// Create the room feeds and announcements. A replacement server relies on getting the same ids for them
+void initialize_topics()
+{
+    char name[TOPIC_MAX_NAME];
+
+    topics = topics_create(MAXCONNECTIONS);
+    for(int r = 0; r < MAXROOMS; ++r)
+    {
+        sprintf(name, "room%d", r);
+        room_topics[r] = topic_add(topics, name);
+    }
+    announcements_topic = topic_add(topics, "announcements");
+}
+
 void *get_in_addr(struct sockaddr *sa)
 {
     if(sa->sa_family == AF_INET)
@@ -85,6 +226,19 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// The address the other end of sockfd connected from, as text. address must hold INET6_ADDRSTRLEN bytes
+void peer_address(int sockfd, char *address)
+{
+    struct sockaddr_storage remoteaddr;
+    socklen_t addrlen = sizeof(remoteaddr);
+
+    if(getpeername(sockfd, (struct sockaddr*)&remoteaddr, &addrlen) == -1 ||
+       inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr*)&remoteaddr), address, INET6_ADDRSTRLEN) == NULL)
+    {
+        strcpy(address, "unknown");
+    }
+}
+
 /*
     Thread synchronized.
     Output msg to server terminal.
@@ -96,23 +250,146 @@ void send_msg_to_self(char *msg, int nbytes)
     pthread_mutex_unlock(&self_terminal_mutex);
 }
 
+// Output msg to the server terminal if the log level allows it
+void log_to_self(enum log_level level, char *msg, int nbytes)
+{
+    if(level <= log_level)
+    {
+        send_msg_to_self(msg, nbytes);
+    }
+}
+
 /*
-    Thread synchronized.
-    Send msg to all clients.
+    What queued output may hold: whatever the rest of the budget leaves it, but never less than its floor. Everything
+    else is bounded or only shrinks as clients leave, so chat is never refused just because that holds the budget.
+*/
+long outbound_budget()
+{
+    long left = budget_limit() - (budget_total() - budget_used(BUDGET_OUTBOUND));
+    long floor = budget_limit() / 100 * OUTBOUND_BUDGET_FLOOR_PERCENT;
+
+    return left > floor ? left : floor;
+}
+
+int outbound_over_budget()
+{
+    return budget_used(BUDGET_OUTBOUND) > outbound_budget();
+}
+
+/*
+    While queued output is over its budget, trim every chat queue holding more than an even share of it, oldest chat
+    first. Slow readers are the ones holding the most, so they lose chat before anyone else does.
 */
-void send_msg_to_clients(char* msg, int nbytes)
+void evict_chat_over_budget()
+{
+    long share;
+
+    if(!outbound_over_budget() || num_users == 0)
+    {
+        return;
+    }
+
+    share = outbound_budget() / num_users;
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0)
+        {
+            chat_evicted += outbound_shed_chat(userlist[i]->out, share);
+        }
+    }
+}
+
+// Queue msg on the given lane of each user's outbound queue. One copy of msg is shared by all of them
+void send_msg_to_users(struct user **users, int nusers, enum outbound_lane lane, char *msg, int nbytes)
+{
+    struct outmsg *m;
+    long long start_ns = trace_current ? trace_now_ns() : 0;
+
+    if(lane == LANE_CHAT)
+    {
+        evict_chat_over_budget();
+    }
+
+    m = outmsg_create(msg, nbytes);
+
+    // Every recipient's flush span starts from the same moment, so they line up on the message's track
+    m->trace_id = trace_current;
+    m->trace_ns = start_ns;
+
+    for(int i = 0; i < nusers; ++i)
+    {
+        outbound_push(users[i]->out, lane, m);
+        outbound_flush(users[i]->out, loop);
+    }
+    outmsg_release(m);
+
+    if(trace_current)
+    {
+        trace_span(trace_current, "enqueue", start_ns, trace_now_ns(), -1);
+    }
+}
+
+// Take the userlist lock, tracing how long it took to get
+void lock_userlist()
 {
+    long long start_ns = trace_current ? trace_now_ns() : 0;
+
     pthread_mutex_lock(&userlist_mutex);
+    if(trace_current)
+    {
+        trace_span(trace_current, "lock wait", start_ns, trace_now_ns(), -1);
+    }
+}
+
+/*
+    Thread synchronized.
+    Send msg to all clients on the given lane.
+*/
+void send_msg_to_clients(enum outbound_lane lane, char* msg, int nbytes)
+{
+    struct user *users[MAXCONNECTIONS];
+    int nusers = 0;
+
+    lock_userlist();
     for(int i = 0; i < MAXCONNECTIONS; ++i)
     {
         if(userlist[i] != 0)
         {
-            send(userlist[i]->sockfd, msg, nbytes, 0);
+            users[nusers++] = userlist[i];
         }
     }
+
+    send_msg_to_users(users, nusers, lane, msg, nbytes);
+    pthread_mutex_unlock(&userlist_mutex);
+}
+
+/*
+    Thread synchronized.
+    Send msg to everyone subscribed to topic on the given lane.
+*/
+void send_msg_to_topic(int topic, enum outbound_lane lane, char *msg, int nbytes)
+{
+    int slots[MAXCONNECTIONS];
+    struct user *users[MAXCONNECTIONS];
+    int nusers;
+
+    lock_userlist();
+    nusers = topic_subscribers(topics, topic, slots, MAXCONNECTIONS);
+    for(int i = 0; i < nusers; ++i)
+    {
+        users[i] = userlist[slots[i]];
+    }
+
+    send_msg_to_users(users, nusers, lane, msg, nbytes);
     pthread_mutex_unlock(&userlist_mutex);
 }
 
+// Send msg to a single client
+void send_msg_to_user(struct user *u, enum outbound_lane lane, char *msg, int nbytes)
+{
+    send_msg_to_users(&u, 1, lane, msg, nbytes);
+}
+
 int open_server_socket()
 {
     int sockfd, rv, yes = 1;
@@ -171,21 +448,16 @@ int open_server_socket()
 
 int find_index_of_user_in_userlist_from_fd(int fd)
 {
-    int i = 0;
-    struct user *cur = userlist[i];
-
-    while(cur == 0 || cur->sockfd != fd)
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
     {
-        cur = userlist[++i];
-
-        // Should never be true, hopefully
-        if(i > sizeof(userlist))
+        if(userlist[i] != 0 && userlist[i]->sockfd == fd)
         {
-            return -1;
+            return i;
         }
     }
 
-    return i;
+    // Not (or no longer) a logged-in user
+    return -1;
 }
 
 int find_empty_userlist_index()
@@ -200,134 +472,47 @@ int find_empty_userlist_index()
     return -1;
 }
 
-// Check if a message is valid
-// A message is valid if it does not contain only spaces or is not of length 0
-int is_valid_message(char *msg)
-{
-    char *cur = msg;
-    
-    while(*cur != '\0')
-    {
-        if(*cur != ' ')
-        {
-            return 1;
-        }
-        cur++;
-    }
-    return 0;
-}
-
-// Check to see if a clients color request is valid, and if so return the index of terminal_colors[] that corresponds to the choice
-int parse_client_color_selection(char* buf)
-{
-    strToLower(buf);
-
-    if(strcmp("green", buf) == 0)
-    {
-        return 2;
-    }
-    else if(strcmp("yellow", buf) == 0)
-    {
-        return 3;
-    }
-    else if(strcmp("blue", buf) == 0)
-    {
-        return 4;
-    }
-    else if(strcmp("magenta", buf) == 0)
-    {
-        return 5;
-    }
-    else if(strcmp("cyan", buf) == 0)
-    {
-        return 6;
-    }
-    else if(strcmp("white", buf) == 0)
-    {
-        return 7;
-    }
-    else
-    {
-        return -1;
-    }
-}
-
-// While adding a client, check to see if there is enough space for them (i.e. num_users < MAXCONNECTIONS)
-int add_client_check_if_space(int clientfd)
-{
-    char confirmation_buf[2];
-    if(num_users >= MAXCONNECTIONS)
-    {
-        send(clientfd, server_is_full_notice, server_is_full_notice_nbytes, 0);
-        return 1;
-    }
-    else
-    {
-        send(clientfd, "0", 2, 0);
-    }
-
-    // Get confirmation from the client
-    if(recv(clientfd, confirmation_buf, 2, 0) == 0)
-    {
-        return 1;
-    }
-    return 0;
-}
-
-// While adding a client, query them for their desired username
-int add_client_query_username(struct user *u, char *buf, int clientfd)
+/*
+    Keep bytes a client sent until they can be handled: the rest of the read that ended their login, or chat during a
+    handoff. The buffer is charged to the budget as per-client state. Only the main thread touches the budget, so for
+    someone still logging in (no slot yet) register_client charges it instead
+*/
+void hold_input(struct user *u, const char *data, int nbytes)
 {
-    send(clientfd, name_request_msg, name_request_msg_nbytes, 0);
-    if(recv(clientfd, buf, 256, 0) == 0)
+    if(u->held_len == -1)
     {
-        return 1;
+        return;
     }
-    strcpy(u->username, buf);
-
-    return 0;
-}
-
-// While adding a client, query them for their desired color, prompting them again if their input is not recognized
-int add_client_query_color(struct user *u, char *buf, int clientfd)
-{
-    int client_color_response;
-    char confirmation_buf[2];
-    char formatted_color_request_msg[256];
-
-    sprintf(formatted_color_request_msg, color_request_msg, buf);
-    send(clientfd, formatted_color_request_msg, strlen(formatted_color_request_msg)+1, 0);
-    if(recv(clientfd, buf, 256, 0) == 0)
+    if(u->held_len + nbytes > HANDOFF_HELD_INPUT)
     {
-        return 1;
+        u->held_len = -1;
+        return;
     }
-
-    client_color_response = parse_client_color_selection(buf);
-
-    // The input was not recognized
-    if(client_color_response == -1)
+    if(u->held == NULL)
     {
-
-        while((client_color_response = parse_client_color_selection(buf)) == -1)
+        if((u->held = malloc(HANDOFF_HELD_INPUT)) == NULL)
         {
-            send(clientfd, "0", 2, 0);
-            send(clientfd, retry_color_dialog, strlen(retry_color_dialog)+1, 0);
-            if(recv(clientfd, buf, 256, 0) == 0)
-            {
-                return 1;
-            }
-
-            client_color_response = parse_client_color_selection(buf);
+            u->held_len = -1;
+            return;
+        }
+        if(u->slot != -1)
+        {
+            budget_charge(BUDGET_CONNECTIONS, HANDOFF_HELD_INPUT);
         }
     }
-    send(clientfd, "1", 2, 0);
-    u->text_color = client_color_response;
+    memcpy(u->held + u->held_len, data, nbytes);
+    u->held_len += nbytes;
+}
 
-    if(recv(clientfd, confirmation_buf, 2, 0) == 0)
+// Let go of what was held for a registered user, and its charge
+void free_held_input(struct user *u)
+{
+    if(u->held != NULL)
     {
-        return 1;
+        budget_release(BUDGET_CONNECTIONS, HANDOFF_HELD_INPUT);
+        free(u->held);
+        u->held = NULL;
     }
-
-    return 0;
 }
 
 // Add a client to the server, querying them for their username and desired color
@@ -335,293 +520,1757 @@ void *add_client(void *thread_info_ptr)
 {
     struct user *user = malloc(sizeof(struct user));
     struct thread_info *thread_info = (struct thread_info*)thread_info_ptr;
+    struct login login;
 
     int joining_client_fd = thread_info->client_fd;
     int wakeup_pipe_fd = thread_info->wakeup_pipe_fd;
-    fd_set *master = thread_info->master;
 
-    int joining_nbytes;
     char input_buf[MAXDATASIZE];
+    int nbytes = 0;
+    int used = 0;
+    long long deadline_ms = now_ms() + LOGIN_TIMEOUT_S * 1000;
+    long long left_ms;
+    struct timeval timeout;
 
-    int empty_userlist_index;
+    free(thread_info);
+
+    // There is room for them (accept_client saw to that), so trade messages until the handshake is over
+    login_start(&login);
+    while(1)
+    {
+        if(login.out_len > 0 && send(joining_client_fd, login.out, login.out_len, MSG_NOSIGNAL) != login.out_len)
+        {
+            goto FAILURE;
+        }
+        if(login.state == LOGIN_DONE || login.state == LOGIN_FAILED)
+        {
+            break;
+        }
+        if(used == nbytes)
+        {
+            // Each wait gets only what is left of the deadline, so trickling bytes in does not extend it
+            if((left_ms = deadline_ms - now_ms()) <= 0)
+            {
+                goto FAILURE;
+            }
+            timeout.tv_sec = left_ms / 1000;
+            timeout.tv_usec = left_ms % 1000 * 1000;
+            setsockopt(joining_client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+            setsockopt(joining_client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
 
-    user->text_color = -1;
+            if((nbytes = recv(joining_client_fd, input_buf, sizeof input_buf, 0)) <= 0)
+            {
+                goto FAILURE;
+            }
+            used = 0;
+        }
+        used += login_feed(&login, input_buf + used, nbytes - used);
+    }
 
-    // Check if there is space for the new client
-    if( add_client_check_if_space(joining_client_fd)                    != 0 ||
-        add_client_query_username(user, input_buf, joining_client_fd)   != 0 ||
-        add_client_query_color(user, input_buf, joining_client_fd)      != 0)
+    if(login.state == LOGIN_FAILED)
     {
         goto FAILURE;
     }
 
-    // Joining confirmation
-    send(joining_client_fd, server_join_msg, server_join_msg_nbytes, 0);
+    // From here on the event loop looks after the socket, with no timeouts
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    setsockopt(joining_client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(joining_client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
 
     user->sockfd = joining_client_fd;
+    user->slot = -1;
+    strcpy(user->username, login.username);
+    peer_address(joining_client_fd, user->address);
+    user->text_color = login.text_color;
+    user->room = 0;
+    user->typing_until_ms = 0;
+    user->muted_until_ms = 0;
+    user->rate_window_start_ms = 0;
+    user->rate_window_msgs = 0;
+    user->busy_notice_ms = 0;
+    user->mute_notice_ms = 0;
+    user->held = NULL;
+    user->held_len = 0;
+    message_reader_init(&user->reader);
+
+    // Chat typed straight after the login can share a read with the last answer. The main thread reads it once they are in
+    if(used < nbytes)
+    {
+        hold_input(user, input_buf + used, nbytes - used);
+    }
 
-    empty_userlist_index = find_empty_userlist_index();
-
-    free(thread_info);
-
-    pthread_mutex_lock(&userlist_mutex);
-    num_users++;
-    userlist[empty_userlist_index] = user;
-    FD_SET(joining_client_fd, master);
-    write(wakeup_pipe_fd, "0", 1); // Write arbitrary byte to write end of the pipe to wakeup select() in main thread
-    pthread_mutex_unlock(&userlist_mutex);
-
-    joining_nbytes = sprintf(input_buf, user_join_notice, terminal_colors[user->text_color], user->username, terminal_colors[0]);
-
-    send_msg_to_self(input_buf, joining_nbytes);
-    send_msg_to_clients(input_buf, joining_nbytes);
+    // Hand the finished user to the main thread, which owns the event loop. Pointer-sized pipe writes are atomic
+    write(wakeup_pipe_fd, &user, sizeof user);
 
     goto SUCCESS;
 
 FAILURE:
     free(user);
+    close(joining_client_fd);
+
+    // The main thread still counts this login as pending until it hears it is over
+    user = NULL;
+    write(wakeup_pipe_fd, &user, sizeof user);
 
 SUCCESS:
     pthread_exit(NULL);
 }
 
-// A client has disconnected, so remove them from the server
-void remove_client(int clientfd, fd_set *master)
+// Memory the kernel holds for a client is outside the budget, so keep it small
+void limit_send_buffer(int fd)
 {
-    char buf[256];
-    int i = find_index_of_user_in_userlist_from_fd(clientfd);
-    int nbytes;
-    struct user *u = userlist[i];
-
-    nbytes = sprintf(buf, user_leave_notice, terminal_colors[u->text_color], u->username, terminal_colors[0]);
-
-    // Remove user from the userlist
-    pthread_mutex_lock(&userlist_mutex);
-    free(userlist[i]);
-    userlist[i] = 0;
-    pthread_mutex_unlock(&userlist_mutex);
-    num_users--;
-
-    // Remove user from master fd_set
-    pthread_mutex_lock(&master_fd_set_mutex);
-    FD_CLR(clientfd, master);
-    pthread_mutex_unlock(&master_fd_set_mutex);
-
-    close(clientfd);
+    int sndbuf = CLIENT_SNDBUF_BYTES;
 
-    send_msg_to_self(buf, nbytes);
-    send_msg_to_clients(buf, nbytes);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
 }
 
 // Prepare a message from the server by prefixing it with server designation and color
-char *prep_server_msg(char* buf)
+char *prep_server_msg(const char *buf)
 {
-    char *msg = (char*)malloc(MAXDATASIZE);
-    sprintf(msg, "%sSERVER:%s %s", terminal_colors[1], terminal_colors[0], buf);
+    int len = strlen(buf);
+    // Sized for all of buf, since the lists passed in can fill MAXDATASIZE by themselves
+    char *msg = malloc(COLORED_NAME_MAX + 1 + len + 1);
+    int nbytes = put_colored_name(msg, COLOR_SERVER_NAME, "SERVER:");
+
+    msg[nbytes] = ' ';
+    memcpy(msg + nbytes + 1, buf, len + 1);
     return msg;
 }
 
-// Prepare a message from a client by prefixing it with that client's username and color
-char *prep_client_msg(int clientfd, char *buf)
+/*
+    Someone who was here before is back: send them what they missed in one batch behind a notice saying so. It goes on
+    the control lane so that budget pressure cannot shed it; it is sent once, before they have anything else queued.
+*/
+void deliver_missed(struct user *u)
 {
-    char *msg = malloc(MAXDATASIZE);
-    struct user *client = userlist[find_index_of_user_in_userlist_from_fd(clientfd)];
+    struct mailbox *m = mailbox_find(u->username);
+    char head[128];
+    char *notice, *missed, *batch;
+    int notice_nbytes, missed_nbytes, lost;
 
-    sprintf(msg, "%s%s%s: %s", terminal_colors[client->text_color], client->username, terminal_colors[0], buf);
+    if(m == NULL)
+    {
+        return;
+    }
 
-    write_to_term(client->username, strlen(client->username)+1);
+    missed = mailbox_collect(m, &room_history[m->room], &missed_nbytes, &lost);
+    mailbox_close(m);
+    if(missed == NULL && lost == 0)
+    {
+        return;
+    }
 
-    return msg;
-}
+    if(lost > 0)
+    {
+        sprintf(head, "While you were away (%d earlier messages could not be kept):\n", lost);
+    }
+    else
+    {
+        sprintf(head, "While you were away:\n");
+    }
+    notice = prep_server_msg(head);
+    notice_nbytes = strlen(notice);
 
-// Send out a message originating from the server
-void send_server_to_clients_msg(char *buf)
-{
-    char *msg = prep_server_msg(buf);
-    int msg_nbytes = strlen(msg);
+    batch = malloc(notice_nbytes + missed_nbytes);
+    memcpy(batch, notice, notice_nbytes);
+    if(missed != NULL)
+    {
+        memcpy(batch + notice_nbytes, missed, missed_nbytes);
+    }
+    send_msg_to_user(u, LANE_CONTROL, batch, notice_nbytes + missed_nbytes);
 
-    write_to_term(msg, msg_nbytes);
-    send_msg_to_clients(msg, msg_nbytes);
-    free(msg);
+    free(batch);
+    free(notice);
+    free(missed);
 }
 
-// Send out a message originating from a client
-void send_client_to_clients_msg(int clientfd, char *buf)
+struct user *find_user_by_name(const char *name);
+
+/*
+    Whether a finished login may not have its name. Names are not authenticated, so one already online is not given
+    out twice, and one whose owner is away is kept for logins from where they connected, who get their mailbox.
+*/
+int name_is_taken(struct user *user)
 {
-    char *msg = prep_client_msg(clientfd, buf);
+    struct mailbox *m;
 
-    write_to_term(msg, strlen(msg)+1);
-    send_msg_to_clients(msg, strlen(msg)+1);
-    free(msg);
+    if(find_user_by_name(user->username) != NULL)
+    {
+        return 1;
+    }
+    return (m = mailbox_find(user->username)) != NULL && strcmp(m->address, user->address) != 0;
 }
 
-void handle_terminal_input(char input)
+// A login thread has finished with a user, so put them in the userlist and start listening to them
+void register_client(struct user *user)
 {
-    switch (input)
-    {
-        case 3: // Ctrl-c
-            exit(0);
+    char buf[256];
+    char *notice;
+    int nbytes;
+    int empty_userlist_index;
+
+    // Only the main thread knows who is online or away, so a clash is found after the handshake and ends it here
+    if(name_is_taken(user))
+    {
+        notice = prep_server_msg(name_taken_notice);
+        send(user->sockfd, notice, strlen(notice), MSG_NOSIGNAL);
+        free(notice);
+        nbytes = sprintf(buf, "Refused %s from %s: the name is taken\n", user->username, user->address);
+        log_to_self(LOG_INFO, buf, nbytes);
+        close(user->sockfd);
+        free(user->held);
+        free(user);
+        return;
+    }
+
+    pthread_mutex_lock(&userlist_mutex);
+    empty_userlist_index = find_empty_userlist_index();
+    if(empty_userlist_index != -1)
+    {
+        num_users++;
+        userlist[empty_userlist_index] = user;
+    }
+    pthread_mutex_unlock(&userlist_mutex);
+
+    // Another login finished first and took the last slot
+    if(empty_userlist_index == -1)
+    {
+        send(user->sockfd, server_is_full_notice, server_is_full_notice_nbytes, MSG_NOSIGNAL);
+        close(user->sockfd);
+        free(user->held);
+        free(user);
+        return;
+    }
+
+    user->slot = empty_userlist_index;
+    budget_charge(BUDGET_CONNECTIONS, sizeof(struct user));
+    if(user->held != NULL)
+    {
+        budget_charge(BUDGET_CONNECTIONS, HANDOFF_HELD_INPUT);
+    }
+    topic_subscribe(topics, room_topics[user->room], user->slot);
+    topic_subscribe(topics, announcements_topic, user->slot);
+
+    limit_send_buffer(user->sockfd);
+    user->out = outbound_create(user->sockfd);
+    event_loop_add_client(loop, user->sockfd);
+
+    nbytes = format_user_notice(buf, NOTICE_JOINED, user->text_color, user->username);
+
+    log_to_self(LOG_INFO, buf, nbytes);
+    send_msg_to_clients(LANE_CONTROL, buf, nbytes);
+    deliver_missed(user);
+}
+
+// Mark a user as typing or not. Their room hears about it with the next presence frame
+void set_typing(struct user *u, int typing)
+{
+    if(typing)
+    {
+        if(u->typing_until_ms == 0)
+        {
+            num_typing++;
+            room_presence_changed[u->room] = 1;
+            presence_changed = 1;
+        }
+        u->typing_until_ms = now_ms() + TYPING_TIMEOUT_MS;
+    }
+    else if(u->typing_until_ms != 0)
+    {
+        num_typing--;
+        u->typing_until_ms = 0;
+        room_presence_changed[u->room] = 1;
+        presence_changed = 1;
+    }
+}
+
+// How long the main loop may sleep before presence frames are due, or -1 if there is nothing to send
+int presence_timeout_ms()
+{
+    long long wait;
+
+    if(num_typing == 0 && !presence_changed)
+    {
+        return -1;
+    }
+
+    wait = next_presence_tick_ms - now_ms();
+    return wait < 0 ? 0 : (int)wait;
+}
+
+/*
+    Once per PRESENCE_INTERVAL_MS, send every room whose typing state changed a single frame listing who is typing.
+    Keystrokes in between only update the user table, so presence traffic is one frame per room per tick.
+*/
+void send_presence_updates()
+{
+    char frames[MAXROOMS][MAXDATASIZE];
+    int frame_nbytes[MAXROOMS];
+    struct user *members[MAXROOMS][MAXCONNECTIONS];
+    int nmembers[MAXROOMS];
+    long long now = now_ms();
+    struct user *u;
+    int r;
+
+    if((num_typing == 0 && !presence_changed) || now < next_presence_tick_ms)
+    {
+        return;
+    }
+    next_presence_tick_ms = now + PRESENCE_INTERVAL_MS;
+
+    // Let lapsed indicators go before building the frames
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0 && userlist[i]->typing_until_ms != 0 && userlist[i]->typing_until_ms <= now)
+        {
+            set_typing(userlist[i], 0);
+        }
+    }
+
+    if(!presence_changed)
+    {
+        return;
+    }
+
+    for(r = 0; r < MAXROOMS; ++r)
+    {
+        frames[r][0] = PRESENCE_FRAME_MARKER;
+        frame_nbytes[r] = 1;
+        nmembers[r] = 0;
+    }
+
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        u = userlist[i];
+        if(u == 0 || !room_presence_changed[u->room])
+        {
+            continue;
+        }
+
+        r = u->room;
+        members[r][nmembers[r]++] = u;
+
+        if(u->typing_until_ms != 0)
+        {
+            frame_nbytes[r] += sprintf(frames[r] + frame_nbytes[r], "%s%s", frame_nbytes[r] > 1 ? PRESENCE_NAME_SEPARATOR : "", u->username);
+        }
+    }
+
+    for(r = 0; r < MAXROOMS; ++r)
+    {
+        if(room_presence_changed[r])
+        {
+            frames[r][frame_nbytes[r]++] = '\n';
+            send_msg_to_users(members[r], nmembers[r], LANE_CONTROL, frames[r], frame_nbytes[r]);
+            room_presence_changed[r] = 0;
+        }
+    }
+    presence_changed = 0;
+}
+
+// A client has disconnected or been kicked, so remove them from the server and tell everyone with notice
+void remove_client(int clientfd, enum user_notice notice)
+{
+    char buf[256];
+    int i = find_index_of_user_in_userlist_from_fd(clientfd);
+    int nbytes;
+    struct user *u;
+
+    // Already gone, e.g. kicked from the console earlier in the batch that also reports their disconnect
+    if(i == -1)
+    {
+        return;
+    }
+    u = userlist[i];
+
+    nbytes = format_user_notice(buf, notice, u->text_color, u->username);
+
+    set_typing(u, 0);
+
+    // Hold on to anything sent their way until they are back
+    mailbox_open(u->username, u->address, u->room, room_history[u->room].next_seq, now_ms());
+
+    // Remove user from the userlist
+    pthread_mutex_lock(&userlist_mutex);
+    topics_unsubscribe_all(topics, i);
+    outbound_destroy(u->out);
+    budget_release(BUDGET_CONNECTIONS, sizeof(struct user));
+    free_held_input(u);
+    free(userlist[i]);
+    userlist[i] = 0;
+    pthread_mutex_unlock(&userlist_mutex);
+    num_users--;
+
+    event_loop_remove(loop, clientfd);
+    close(clientfd);
+
+    log_to_self(LOG_INFO, buf, nbytes);
+    send_msg_to_clients(LANE_CONTROL, buf, nbytes);
+}
+
+// Prepare a message from a client by prefixing it with that client's username and color
+// buf has already been through message_sanitize(), so it is a single line without its LF
+char *prep_client_msg(int clientfd, char *buf)
+{
+    // Room for the room tag and colored name ahead of the longest message a client can send
+    char *msg = malloc(TOPIC_MAX_NAME + 3 + COLORED_NAME_MAX + 2 + SESSION_MAX_MESSAGE + 1);
+    struct user *client = userlist[find_index_of_user_in_userlist_from_fd(clientfd)];
+    const char *room;
+    char *p = msg;
+    int len = strlen(buf);
+    int room_len;
+
+    // Chat outside the main room is tagged with where it came from, for those following several rooms
+    if(client->room != 0)
+    {
+        room = topic_name(topics, room_topics[client->room]);
+        room_len = strlen(room);
+        *p++ = '[';
+        memcpy(p, room, room_len);
+        p += room_len;
+        memcpy(p, "] ", 2);
+        p += 2;
+    }
+    p += put_colored_name(p, client->text_color, client->username);
+    memcpy(p, ": ", 2);
+    memcpy(p + 2, buf, len);
+    memcpy(p + 2 + len, "\n", 2);
+
+    write_to_term(client->username, strlen(client->username)+1);
+
+    return msg;
+}
+
+// Send out a message originating from the server
+void send_server_to_clients_msg(char *buf)
+{
+    char *msg = prep_server_msg(buf);
+    int msg_nbytes = strlen(msg);
+
+    write_to_term(msg, msg_nbytes);
+    send_msg_to_topic(announcements_topic, LANE_CONTROL, msg, msg_nbytes);
+    free(msg);
+}
+
+// Send out a message originating from a client
+void send_client_to_clients_msg(int clientfd, char *buf)
+{
+    long long start_ns = trace_current ? trace_now_ns() : 0;
+    char *msg = prep_client_msg(clientfd, buf);
+    struct user *sender = userlist[find_index_of_user_in_userlist_from_fd(clientfd)];
+    struct mailbox *mentioned[MAILBOX_MAX];
+    int nmentioned;
+    int nbytes = strlen(msg)+1;
+
+    if(trace_current)
+    {
+        trace_span(trace_current, "format", start_ns, trace_now_ns(), clientfd);
+    }
+
+    write_to_term(msg, nbytes);
+    send_msg_to_topic(room_topics[sender->room], LANE_CHAT, msg, nbytes);
+    msgs_relayed++;
+
+    // Kept for whoever left the room, and mentions of absent users from other rooms go to their mailboxes. Mentions
+    // in the room they left already come back to them with its history
+    history_append(&room_history[sender->room], msg, nbytes);
+    nmentioned = mailbox_find_mentions(buf, mentioned, MAILBOX_MAX);
+    for(int i = 0; i < nmentioned; ++i)
+    {
+        if(mentioned[i]->room != sender->room)
+        {
+            mailbox_deliver(mentioned[i], msg, nbytes);
+        }
+    }
+    free(msg);
+}
+
+// Send a short notice from the server to one user
+void send_server_to_user_msg(struct user *u, char *buf)
+{
+    char *msg = prep_server_msg(buf);
+
+    send_msg_to_user(u, LANE_CONTROL, msg, strlen(msg));
+    free(msg);
+}
+
+/*
+    Check whether a user may chat right now, telling them once per window if they may not.
+    Returns 1 if the message should be dropped.
+*/
+int chat_is_blocked(struct user *u)
+{
+    long long now = now_ms();
+    char buf[256];
+    int nbytes;
+
+    if(u->muted_until_ms != 0 && u->muted_until_ms <= now)
+    {
+        u->muted_until_ms = 0;
+    }
+
+    if(u->muted_until_ms != 0)
+    {
+        msgs_muted++;
+        nbytes = sprintf(buf, "Dropped a message from muted user %s\n", u->username);
+        log_to_self(LOG_DEBUG, buf, nbytes);
+        if(now - u->mute_notice_ms >= MUTE_NOTICE_INTERVAL_MS)
+        {
+            u->mute_notice_ms = now;
+            send_server_to_user_msg(u, "You are muted.\n");
+        }
+        return 1;
+    }
+
+    // Backpressure: with no room for queued output even after evicting chat, new chat is turned away at the door
+    evict_chat_over_budget();
+    if(outbound_over_budget())
+    {
+        msgs_over_budget++;
+        nbytes = sprintf(buf, "Over the memory budget, dropped a message from %s\n", u->username);
+        log_to_self(LOG_DEBUG, buf, nbytes);
+        if(now - u->busy_notice_ms >= BUSY_NOTICE_INTERVAL_MS)
+        {
+            u->busy_notice_ms = now;
+            send_server_to_user_msg(u, "The server is overloaded; your message was not delivered.\n");
+        }
+        return 1;
+    }
+
+    if(rate_limit_msgs == 0)
+    {
+        return 0;
+    }
+
+    if(now - u->rate_window_start_ms >= rate_limit_window_ms)
+    {
+        u->rate_window_start_ms = now;
+        u->rate_window_msgs = 0;
+    }
+
+    if(++u->rate_window_msgs <= rate_limit_msgs)
+    {
+        return 0;
+    }
+
+    msgs_rate_limited++;
+    nbytes = sprintf(buf, "Rate limited a message from %s\n", u->username);
+    log_to_self(LOG_DEBUG, buf, nbytes);
+    if(u->rate_window_msgs == rate_limit_msgs + 1)
+    {
+        send_server_to_user_msg(u, "You are sending messages too quickly; some were not delivered.\n");
+    }
+    return 1;
+}
+
+// Tell a client who is on the server
+void send_who_list(struct user *u)
+{
+    char list[MAXDATASIZE];
+    char *msg;
+    int nbytes;
+    int listed = 0;
+
+    nbytes = sprintf(list, "Online (%d):", num_users);
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0)
+        {
+            nbytes += sprintf(list + nbytes, "%s %s%s%s [room %d]", listed++ > 0 ? "," : "", colors[userlist[i]->text_color].escape, userlist[i]->username, colors[COLOR_RESET].escape, userlist[i]->room);
+        }
+    }
+    list[nbytes++] = '\n';
+    list[nbytes] = '\0';
+
+    msg = prep_server_msg(list);
+    send_msg_to_user(u, LANE_CONTROL, msg, strlen(msg));
+    free(msg);
+}
+
+// Check if a command word matches, ignoring whatever follows it on the line
+int is_command(char *buf, const char *command)
+{
+    int len = strlen(command);
+    return strncmp(buf, command, len) == 0 && (buf[len] == '\0' || isspace((unsigned char)buf[len]));
+}
+
+// The word after a command, e.g. the topic in "/subscribe room3". Returns 0 if there is none
+int command_argument(char *buf, char *arg, int arg_size)
+{
+    int len = 0;
+
+    while(*buf != '\0' && !isspace((unsigned char)*buf))
+    {
+        buf++;
+    }
+    while(isspace((unsigned char)*buf))
+    {
+        buf++;
+    }
+    while(buf[len] != '\0' && !isspace((unsigned char)buf[len]) && len < arg_size - 1)
+    {
+        arg[len] = buf[len];
+        len++;
+    }
+    arg[len] = '\0';
+
+    return len > 0;
+}
+
+// Tell a client which topics there are, marking the ones they hear
+void send_topic_list(struct user *u)
+{
+    char list[MAXDATASIZE];
+    int nbytes;
+
+    nbytes = sprintf(list, "Topics (* subscribed, you post in %s):", topic_name(topics, room_topics[u->room]));
+    for(int i = 0; i < topics->count && nbytes < MAXDATASIZE - TOPIC_MAX_NAME - 8; ++i)
+    {
+        nbytes += sprintf(list + nbytes, " %s%s", topic_name(topics, i), topic_is_subscribed(topics, i, u->slot) ? "*" : "");
+    }
+    list[nbytes++] = '\n';
+    list[nbytes] = '\0';
+
+    send_server_to_user_msg(u, list);
+}
+
+// Start or stop hearing a topic
+void change_subscription(struct user *u, char *buf, int subscribe)
+{
+    char name[TOPIC_MAX_NAME];
+    char reply[TOPIC_MAX_NAME + 64];
+    int topic;
+
+    if(!command_argument(buf, name, sizeof name) || (topic = topic_find(topics, name)) == -1)
+    {
+        send_server_to_user_msg(u, "No such topic. /topics lists them.\n");
+        return;
+    }
+
+    if(subscribe)
+    {
+        topic_subscribe(topics, topic, u->slot);
+        sprintf(reply, "Subscribed to %s.\n", name);
+    }
+    else
+    {
+        topic_unsubscribe(topics, topic, u->slot);
+        sprintf(reply, "Unsubscribed from %s.\n", name);
+    }
+    send_server_to_user_msg(u, reply);
+}
+
+// The online user with this name, or NULL if there is none
+struct user *find_user_by_name(const char *name)
+{
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0 && strcmp(userlist[i]->username, name) == 0)
+        {
+            return userlist[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+    Send a direct message: "/msg <user> <text>". It goes straight to them if they are online, or into their mailbox if
+    they have been here before and are away.
+*/
+void send_direct_message(struct user *u, char *buf)
+{
+    static const char to_you[] = " (to you): ";
+    char name[MAX_USERNAME_LENGTH];
+    char reply[128];
+    char *text = buf;
+    char *msg;
+    struct user *to;
+    struct mailbox *m;
+    int nbytes, len;
+
+    // The text is whatever follows the command and the name
+    for(int field = 0; field < 2; ++field)
+    {
+        while(*text != '\0' && !isspace((unsigned char)*text))
+        {
+            text++;
+        }
+        while(isspace((unsigned char)*text))
+        {
+            text++;
+        }
+    }
+
+    if(!command_argument(buf, name, sizeof name) || *text == '\0')
+    {
+        send_server_to_user_msg(u, "usage: " MSG_COMMAND " <user> <message>\n");
+        return;
+    }
+
+    len = strlen(text);
+    msg = malloc(COLORED_NAME_MAX + sizeof to_you + len + 2);
+    nbytes = put_colored_name(msg, u->text_color, u->username);
+    memcpy(msg + nbytes, to_you, sizeof to_you - 1);
+    nbytes += sizeof to_you - 1;
+    memcpy(msg + nbytes, text, len);
+    nbytes += len;
+    memcpy(msg + nbytes, "\n", 2);
+    nbytes += 2;
+
+    if((to = find_user_by_name(name)) != NULL)
+    {
+        send_msg_to_user(to, LANE_CHAT, msg, nbytes);
+    }
+    else if((m = mailbox_find(name)) != NULL)
+    {
+        mailbox_deliver(m, msg, nbytes);
+        sprintf(reply, "%s is away and will get your message when they are back.\n", name);
+        send_server_to_user_msg(u, reply);
+    }
+    else
+    {
+        sprintf(reply, "No one called %s has been here.\n", name);
+        send_server_to_user_msg(u, reply);
+    }
+    free(msg);
+}
+
+// Move a user to another room: their chat goes there and they hear its feed instead of the old room's
+void join_room(struct user *u, char *buf)
+{
+    char arg[16];
+    char reply[64];
+    int room;
+
+    if(!command_argument(buf, arg, sizeof arg) || sscanf(arg, "%d", &room) != 1 || room < 0 || room >= MAXROOMS)
+    {
+        sprintf(reply, "Usage: %s <room 0-%d>\n", JOIN_COMMAND, MAXROOMS - 1);
+        send_server_to_user_msg(u, reply);
+        return;
+    }
+
+    // Their typing indicator stays behind in the old room
+    set_typing(u, 0);
+
+    topic_unsubscribe(topics, room_topics[u->room], u->slot);
+    u->room = room;
+    topic_subscribe(topics, room_topics[u->room], u->slot);
+
+    sprintf(reply, "You are now in room %d.\n", room);
+    send_server_to_user_msg(u, reply);
+}
+
+// Carry out a command sent by a client instead of passing it on to the room
+void handle_client_command(int clientfd, char *buf)
+{
+    struct user *u = userlist[find_index_of_user_in_userlist_from_fd(clientfd)];
+    char log[MAX_USERNAME_LENGTH + MAXDATASIZE + 3];
+    int nbytes;
+
+    nbytes = sprintf(log, "%s: %s\n", u->username, buf);
+    log_to_self(LOG_DEBUG, log, nbytes);
+
+    switch(client_command_lookup(buf))
+    {
+        case CMD_TYPING:
+            set_typing(u, 1);
+            break;
+        case CMD_WHO:
+            send_who_list(u);
+            break;
+        case CMD_JOIN:
+            join_room(u, buf);
+            break;
+        case CMD_SUBSCRIBE:
+            change_subscription(u, buf, 1);
+            break;
+        case CMD_UNSUBSCRIBE:
+            change_subscription(u, buf, 0);
+            break;
+        case CMD_TOPICS:
+            send_topic_list(u);
+            break;
+        case CMD_MSG:
+            send_direct_message(u, buf);
+            break;
+        default:
+            send_server_to_user_msg(u, "Unknown command.\n");
+            break;
+    }
+}
+
+// Take the listening socket in or out of the event loop to match whether new connections should be taken now
+void update_listener()
+{
+    int want = !draining && handoff_conn == -1;
+
+    if(want && !listening)
+    {
+        event_loop_add_listener(loop, server_sockfd);
+    }
+    else if(!want && listening)
+    {
+        event_loop_remove(loop, server_sockfd);
+    }
+    listening = want;
+}
+
+int total_outbound_bytes()
+{
+    int nbytes = 0;
+
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0)
+        {
+            nbytes += outbound_queued_bytes(userlist[i]->out);
+        }
+    }
+    return nbytes;
+}
+
+/*
+    Operator commands typed on the server console. They run on the main thread between events, touch only the user
+    table and queue their output like any other send, so the chat carries on around them.
+*/
+
+// Print a line of command output on the server terminal
+void admin_reply(const char *fmt, ...)
+{
+    char buf[MAXDATASIZE];
+    int nbytes;
+    va_list args;
+
+    va_start(args, fmt);
+    nbytes = vsnprintf(buf, sizeof buf - 1, fmt, args);
+    va_end(args);
+
+    if(nbytes > (int)sizeof buf - 2)
+    {
+        nbytes = sizeof buf - 2;
+    }
+    buf[nbytes++] = '\n';
+    send_msg_to_self(buf, nbytes);
+}
+
+void admin_kick(char *args)
+{
+    char name[MAX_USERNAME_LENGTH];
+    struct user *u;
+
+    if(sscanf(args, "%19s", name) != 1)
+    {
+        admin_reply("usage: /kick <username>");
+    }
+    else if((u = find_user_by_name(name)) == NULL)
+    {
+        admin_reply("No user named %s.", name);
+    }
+    else
+    {
+        remove_client(u->sockfd, NOTICE_KICKED);
+        admin_reply("Kicked %s.", name);
+    }
+}
+
+void admin_mute(char *args, int mute)
+{
+    char name[MAX_USERNAME_LENGTH];
+    int seconds = 0;
+    struct user *u;
+
+    if(sscanf(args, "%19s %d", name, &seconds) < 1 || seconds < 0)
+    {
+        admin_reply(mute ? "usage: /mute <username> [seconds]" : "usage: /unmute <username>");
+        return;
+    }
+    if((u = find_user_by_name(name)) == NULL)
+    {
+        admin_reply("No user named %s.", name);
+        return;
+    }
+
+    if(!mute)
+    {
+        u->muted_until_ms = 0;
+        send_server_to_user_msg(u, "You are no longer muted.\n");
+        admin_reply("Unmuted %s.", name);
+    }
+    else
+    {
+        u->muted_until_ms = seconds > 0 ? now_ms() + seconds * 1000LL : MUTED_FOREVER;
+        set_typing(u, 0);
+        u->mute_notice_ms = now_ms();
+        send_server_to_user_msg(u, "You have been muted.\n");
+        admin_reply(seconds > 0 ? "Muted %s for %d seconds." : "Muted %s until unmuted.", name, seconds);
+    }
+}
+
+// Server totals, then each user's outbound queue
+void admin_stats()
+{
+    struct user *u;
+    long long now = now_ms();
+
+    admin_reply("Backend %s, %d/%d users, %d logging in, %s", event_loop_backend_name(loop), num_users, MAXCONNECTIONS, pending_logins,
+                draining ? "draining" : listening ? "accepting" : "deferring new connections");
+    admin_reply("Loop lag %lld ms, %d bytes queued for clients, %lu connections refused", loop_lag_ms, total_outbound_bytes(), connections_refused);
+    admin_reply("Relayed %lu messages, dropped %lu rate limited, %lu muted and %lu over budget", msgs_relayed, msgs_rate_limited, msgs_muted, msgs_over_budget);
+    admin_reply("Memory %ld of %ld bytes: %s %ld, %s %ld, %s %ld, %s %ld; %lu chat frames evicted", budget_total(), budget_limit(),
+                budget_class_name(BUDGET_OUTBOUND), budget_used(BUDGET_OUTBOUND), budget_class_name(BUDGET_CONNECTIONS), budget_used(BUDGET_CONNECTIONS),
+                budget_class_name(BUDGET_LOGINS), budget_used(BUDGET_LOGINS), budget_class_name(BUDGET_HISTORY), budget_used(BUDGET_HISTORY), chat_evicted);
+    admin_reply("%d mailboxes held for users who are away", mailbox_count());
+    if(rate_limit_msgs > 0)
+    {
+        admin_reply("Rate limit %d messages per %d ms, log level %s", rate_limit_msgs, rate_limit_window_ms, log_level_names[log_level]);
+    }
+    else
+    {
+        admin_reply("No rate limit, log level %s", log_level_names[log_level]);
+    }
+
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if((u = userlist[i]) == 0)
+        {
+            continue;
+        }
+        admin_reply("  %-*s room %-2d queued %6d bytes (+%d state), chat shed %lu, control dropped %lu%s%s", MAX_USERNAME_LENGTH, u->username, u->room,
+                    outbound_queued_bytes(u->out), (int)(sizeof(struct user) + sizeof(struct outbound)), u->out->chat_shed, u->out->control_dropped,
+                    u->out->broken ? ", broken" : "", u->muted_until_ms > now ? ", muted" : "");
+    }
+}
+
+void admin_rooms()
+{
+    char list[MAXDATASIZE];
+    int nbytes, members;
+
+    for(int r = 0; r < MAXROOMS; ++r)
+    {
+        nbytes = 0;
+        members = 0;
+        for(int i = 0; i < MAXCONNECTIONS; ++i)
+        {
+            if(userlist[i] != 0 && userlist[i]->room == r)
+            {
+                nbytes += sprintf(list + nbytes, "%s%s", members++ > 0 ? ", " : "", userlist[i]->username);
+            }
+        }
+
+        if(members > 0 || topic_subscriber_count(topics, room_topics[r]) > 0)
+        {
+            list[nbytes] = '\0';
+            admin_reply("Room %d (%d, %d following): %s", r, members, topic_subscriber_count(topics, room_topics[r]), list);
+        }
+    }
+}
+
+// Stop or resume taking new connections. Users already on the server are not affected
+void admin_drain(char *args)
+{
+    int drain = strcmp(args, "off") != 0;
+
+    if(drain == draining)
+    {
+        admin_reply(draining ? "Already draining." : "Already accepting connections.");
+        return;
+    }
+
+    draining = drain;
+    update_listener();
+    if(draining)
+    {
+        admin_reply("Draining: no longer accepting connections. /drain off to resume.");
+    }
+    else
+    {
+        admin_reply("Accepting connections again.");
+    }
+}
+
+void admin_rate_limit(char *args)
+{
+    int msgs, window_ms = RATE_LIMIT_WINDOW_MS;
+
+    if(sscanf(args, "%d %d", &msgs, &window_ms) < 1 || msgs < 0 || window_ms <= 0)
+    {
+        admin_reply("usage: /ratelimit <messages> [window ms], 0 messages for no limit");
+        return;
+    }
+
+    rate_limit_msgs = msgs;
+    rate_limit_window_ms = window_ms;
+    if(msgs == 0)
+    {
+        admin_reply("Rate limit off.");
+    }
+    else
+    {
+        admin_reply("Rate limit %d messages per %d ms.", msgs, window_ms);
+    }
+}
+
+void admin_budget(char *args)
+{
+    long nbytes;
+
+    if(sscanf(args, "%ld", &nbytes) != 1 || nbytes <= 0)
+    {
+        admin_reply("usage: /budget <bytes> (now %ld, %ld in use)", budget_limit(), budget_total());
+        return;
+    }
+
+    budget_set_limit(nbytes);
+    evict_chat_over_budget();
+    admin_reply("Memory budget %ld bytes, %ld in use.", budget_limit(), budget_total());
+}
+
+void admin_log_level(char *args)
+{
+    for(int level = LOG_ERROR; level <= LOG_DEBUG; ++level)
+    {
+        if(strcmp(args, log_level_names[level]) == 0)
+        {
+            log_level = level;
+            admin_reply("Log level %s.", log_level_names[level]);
+            return;
+        }
+    }
+    admin_reply("usage: /loglevel error|info|debug (now %s)", log_level_names[log_level]);
+}
+
+// Sample one chat message in so many, dump what has been traced, or stop
+void admin_trace(char *args)
+{
+    char path[256];
+    int every, n;
+
+    if(sscanf(args, "dump %255s", path) == 1 || strcmp(args, "dump") == 0)
+    {
+        if(strcmp(args, "dump") == 0)
+        {
+            strcpy(path, TRACE_DEFAULT_FILE);
+        }
+        if((n = trace_dump(path)) == -1)
+        {
+            admin_reply("Could not write %s: %s", path, strerror(errno));
+        }
+        else
+        {
+            admin_reply("Wrote %d trace events to %s.", n, path);
+        }
+    }
+    else if(strcmp(args, "off") == 0)
+    {
+        trace_set_sampling(0);
+        admin_reply("Tracing off, %lu spans recorded.", trace_recorded());
+    }
+    else if(sscanf(args, "%d", &every) == 1 && every > 0)
+    {
+        trace_set_sampling(every);
+        admin_reply("Tracing one message in %d.", every);
+    }
+    else
+    {
+        admin_reply("usage: /trace <one in n messages>|off|dump [file] (now %s)", trace_enabled() ? "on" : "off");
+    }
+}
+
+// Carry out a line typed on the console that starts with COMMAND_PREFIX
+void handle_admin_command(char *buf)
+{
+    char *args = buf;
+
+    // Arguments start after the command word and any spaces
+    while(*args != '\0' && !isspace((unsigned char)*args))
+    {
+        args++;
+    }
+    while(isspace((unsigned char)*args))
+    {
+        args++;
+    }
+
+    if(is_command(buf, "/kick"))
+    {
+        admin_kick(args);
+    }
+    else if(is_command(buf, "/mute"))
+    {
+        admin_mute(args, 1);
+    }
+    else if(is_command(buf, "/unmute"))
+    {
+        admin_mute(args, 0);
+    }
+    else if(is_command(buf, "/stats"))
+    {
+        admin_stats();
+    }
+    else if(is_command(buf, "/rooms"))
+    {
+        admin_rooms();
+    }
+    else if(is_command(buf, "/drain"))
+    {
+        admin_drain(args);
+    }
+    else if(is_command(buf, "/ratelimit"))
+    {
+        admin_rate_limit(args);
+    }
+    else if(is_command(buf, "/loglevel"))
+    {
+        admin_log_level(args);
+    }
+    else if(is_command(buf, "/budget"))
+    {
+        admin_budget(args);
+    }
+    else if(is_command(buf, "/trace"))
+    {
+        admin_trace(args);
+    }
+    else
+    {
+        admin_reply("Commands: /kick <user>, /mute <user> [seconds], /unmute <user>, /stats, /rooms, /drain [off], "
+                    "/ratelimit <messages> [window ms], /loglevel error|info|debug, /budget <bytes>, /trace <n>|off|dump [file]");
+    }
+}
+
+void handle_terminal_input(char input)
+{
+    switch (input)
+    {
+        case 3: // Ctrl-c
+            exit(0);
+
+        case 10: // LF
+            terminal_buf[terminal_buf_len] = '\0';
+            if(terminal_buf[0] == COMMAND_PREFIX)
+            {
+                handle_admin_command(terminal_buf);
+                terminal_buf_len = 0;
+                terminal_buf[terminal_buf_len] = '\0';
+            }
+            else
+            {
+                // Pasted text can carry escape sequences as easily as a client's can
+                terminal_buf_len = message_sanitize(terminal_buf, terminal_buf_len);
+                if(terminal_buf_len != -1)
+                {
+                    terminal_buf[terminal_buf_len++] = 10; // LF
+                    terminal_buf[terminal_buf_len] = '\0';
+                    send_server_to_clients_msg(terminal_buf);
+                }
+                terminal_buf_len = 0;
+                terminal_buf[terminal_buf_len] = '\0';
+            }
+            break;
+
+        case 127: // Backspace
+            if(terminal_buf_len > 0)
+            {
+                terminal_buf[--terminal_buf_len] = '\0';
+                write_backspace_to_input_line();
+            }
+            break;
+    
+        // The input was not one of the special cases handled above, so send to the input buffer
+        default:
+            if(terminal_buf_len < 254)
+            {
+                terminal_buf[terminal_buf_len++] = input;
+            }
+            write_char_to_input_line(input);
+            break;
+    }
+}
+
+/*
+    Decide, before any thread is started, whether a new connection can be looked after. If not, it is told when to
+    try again and closed. Returns 1 if the connection was refused.
+*/
+int refuse_connection(int newfd)
+{
+    char notice[MAXDATASIZE];
+    int nbytes;
+
+    if(num_users + pending_logins >= MAXCONNECTIONS)
+    {
+        nbytes = sprintf(notice, "%s " RETRY_AFTER_HINT, server_is_full_notice, FULL_RETRY_AFTER_S);
+    }
+    else if(pending_logins >= MAX_PENDING_LOGINS || loop_lag_ms > ADMISSION_LAG_LIMIT_MS ||
+            budget_total() > budget_limit() / 100 * ADMISSION_BUDGET_PERCENT)
+    {
+        nbytes = sprintf(notice, "%s " RETRY_AFTER_HINT, server_is_busy_notice, BUSY_RETRY_AFTER_S);
+    }
+    else
+    {
+        return 0;
+    }
 
-        case 10: // LF
-            if(is_valid_message(terminal_buf))
+    // A fresh socket's buffer is empty, so this never waits
+    send(newfd, notice, nbytes + 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(newfd);
+    connections_refused++;
+    return 1;
+}
+
+// Announce a freshly accepted connection and start a thread to log them in
+void accept_client(int newfd)
+{
+    char buf[256];
+    char remoteIP[INET6_ADDRSTRLEN];
+    int nbytes;
+    pthread_t thread;
+    pthread_attr_t attr;
+    struct thread_info *ti;
+
+    peer_address(newfd, remoteIP);
+
+    if(refuse_connection(newfd))
+    {
+        nbytes = sprintf(buf, "Refused connection from %s\n", remoteIP);
+        log_to_self(LOG_INFO, buf, nbytes);
+        return;
+    }
+
+    nbytes = sprintf(buf, "New connection from %s\n", remoteIP);
+    log_to_self(LOG_INFO, buf, nbytes);
+
+    ti = malloc(sizeof *ti);
+    ti->client_fd = newfd;
+    ti->wakeup_pipe_fd = pipefd[1];
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOGIN_THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&thread, &attr, add_client, (void*)ti) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        free(ti);
+        close(newfd);
+        return;
+    }
+    pthread_attr_destroy(&attr);
+
+    pending_logins++;
+    budget_charge(BUDGET_LOGINS, LOGIN_THREAD_STACK_SIZE);
+    update_listener();
+}
+
+void handle_event(struct event *ev);
+
+int all_outbound_idle()
+{
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0 && !outbound_idle(userlist[i]->out))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Keep the loop running until everything queued for clients has gone out, or timeout_ms passes. What clients send
+    meanwhile is held rather than relayed, so the queues only shrink.
+*/
+void drain_outbound(int timeout_ms)
+{
+    struct event events[EVENT_LOOP_MAX_EVENTS];
+    long long deadline_ms = now_ms() + timeout_ms;
+    long long left_ms;
+    int nevents;
+
+    handing_off = 1;
+    while(!all_outbound_idle() && (left_ms = deadline_ms - now_ms()) > 0)
+    {
+        if((nevents = event_loop_wait(loop, events, EVENT_LOOP_MAX_EVENTS, left_ms)) == -1)
+        {
+            break;
+        }
+        for(int i = 0; i < nevents; ++i)
+        {
+            handle_event(&events[i]);
+        }
+    }
+    handing_off = 0;
+}
+
+/*
+    Give the listening socket and every logged-in client to a replacement server, then exit.
+    Clients' output is drained first, so each stream the replacement takes over ends on a frame boundary. Anyone whose
+    output still has not gone out by the deadline, or who sent more than can be held meanwhile, is disconnected
+    instead, since their stream may end mid-frame or their chat would be lost.
+*/
+void hand_off_to_new_server(int conn)
+{
+    struct handoff_header header;
+    struct handoff_user record;
+    struct event events[EVENT_LOOP_MAX_EVENTS];
+    char stopped[MAXCONNECTIONS] = {0}; // 1 while a user's reads are being stopped, 2 once the last of them is held
+    int num_stopping = 0;
+    long long deadline_ms;
+    long long left_ms;
+    char buf[128];
+    int nbytes, nevents, index;
+
+    drain_outbound(HANDOFF_DRAIN_MS);
+
+    /*
+        Stop reading from everyone who can be handed off. The loop may already have read more from them than it has
+        reported, so keep holding what it reports until it says it is done with each of them. Anything they send after
+        that is left in the socket for the replacement. New logins and connections are left for it too
+    */
+    handing_off = 1;
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0 && outbound_idle(userlist[i]->out) && userlist[i]->held_len != -1
+            && event_loop_stop_reading(loop, userlist[i]->sockfd) == 0)
+        {
+            stopped[i] = 1;
+            num_stopping++;
+        }
+    }
+    deadline_ms = now_ms() + HANDOFF_STOP_MS;
+    while(num_stopping > 0 && (left_ms = deadline_ms - now_ms()) > 0)
+    {
+        if((nevents = event_loop_wait(loop, events, EVENT_LOOP_MAX_EVENTS, left_ms)) == -1)
+        {
+            break;
+        }
+        for(int i = 0; i < nevents; ++i)
+        {
+            if(events[i].type == EVENT_DATA && events[i].result == -ECANCELED)
             {
-                terminal_buf[terminal_buf_len++] = 10; // LF
-                terminal_buf[terminal_buf_len] = '\0';
-                send_server_to_clients_msg(terminal_buf);
-                terminal_buf_len = 0;
-                terminal_buf[terminal_buf_len] = '\0';
+                if((index = find_index_of_user_in_userlist_from_fd(events[i].fd)) != -1 && stopped[index] == 1)
+                {
+                    stopped[index] = 2;
+                    num_stopping--;
+                }
             }
-            break;
+            else if(events[i].type == EVENT_DATA || events[i].type == EVENT_SENT)
+            {
+                handle_event(&events[i]);
+            }
+        }
+    }
+    handing_off = 0;
 
-        case 127: // Backspace
-            if(terminal_buf_len > 0)
+    pthread_mutex_lock(&userlist_mutex);
+
+    header.magic = HANDOFF_MAGIC;
+    header.num_users = 0;
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0 && stopped[i] == 2 && userlist[i]->held_len != -1)
+        {
+            header.num_users++;
+        }
+        else if(userlist[i] != 0)
+        {
+            nbytes = sprintf(buf, "%s could not be handed off cleanly; disconnecting\n", userlist[i]->username);
+            log_to_self(LOG_ERROR, buf, nbytes);
+        }
+    }
+
+    if(handoff_send(conn, &header, sizeof header, server_sockfd) == -1)
+    {
+        pthread_mutex_unlock(&userlist_mutex);
+        fprintf(stderr, "handoff: failed, carrying on\n");
+        close(conn);
+        return;
+    }
+
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0 && stopped[i] == 2 && userlist[i]->held_len != -1)
+        {
+            memset(&record, 0, sizeof record);
+            strcpy(record.username, userlist[i]->username);
+            record.text_color = userlist[i]->text_color;
+            record.room = userlist[i]->room;
+            record.muted_until_ms = userlist[i]->muted_until_ms;
+            record.topics = 0;
+            for(int topic = 0; topic < topics->count && topic < 64; ++topic)
             {
-                terminal_buf[--terminal_buf_len] = '\0';
-                write_backspace_to_input_line();
+                if(topic_is_subscribed(topics, topic, i))
+                {
+                    record.topics |= (uint64_t)1 << topic;
+                }
             }
-            break;
-    
-        // The input was not one of the special cases handled above, so send to the input buffer
-        default:
-            if(terminal_buf_len < 254)
+            record.reader_len = userlist[i]->reader.len;
+            record.reader_discarding = userlist[i]->reader.discarding;
+            memcpy(record.reader_buf, userlist[i]->reader.buf, userlist[i]->reader.len);
+            if(userlist[i]->held != NULL)
             {
-                terminal_buf[terminal_buf_len++] = input;
+                record.held_len = userlist[i]->held_len;
+                memcpy(record.held, userlist[i]->held, userlist[i]->held_len);
             }
-            write_char_to_input_line(input);
+
+            if(handoff_send(conn, &record, sizeof record, userlist[i]->sockfd) == -1)
+            {
+                // The replacement now owns the listening socket, so there is no going back
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&userlist_mutex);
+
+    // Logins still in progress are dropped; those clients have to reconnect
+    clear_input_line();
+    printf("Handed %u users off to the new server, exiting.\n", header.num_users);
+    exit(0);
+}
+
+// Take the listening socket and every logged-in client over from a running server. Returns the listening socket
+int take_over_from_old_server()
+{
+    struct handoff_header header;
+    struct handoff_user record;
+    struct user *user;
+    int conn, fd, listenfd;
+    char c;
+
+    if(handoff_path(handoff_socket_path, sizeof handoff_socket_path, HANDOFF_NAME) == -1 || (conn = handoff_connect(handoff_socket_path)) == -1)
+    {
+        fprintf(stderr, "server: no running server to take over from\n");
+        exit(1);
+    }
+
+    if(handoff_recv(conn, &header, sizeof header, &listenfd) == -1 || listenfd == -1 || header.magic != HANDOFF_MAGIC)
+    {
+        fprintf(stderr, "server: running server did not hand off its sockets\n");
+        exit(1);
+    }
+
+    for(uint32_t i = 0; i < header.num_users && i < MAXCONNECTIONS; ++i)
+    {
+        if(handoff_recv(conn, &record, sizeof record, &fd) == -1 || fd == -1)
+        {
             break;
+        }
+
+        user = malloc(sizeof(struct user));
+        user->sockfd = fd;
+        user->slot = find_empty_userlist_index();
+        peer_address(fd, user->address);
+        memcpy(user->username, record.username, MAX_USERNAME_LENGTH);
+        user->username[MAX_USERNAME_LENGTH-1] = '\0';
+        user->text_color = (record.text_color >= 0 && record.text_color < COLOR_COUNT) ? record.text_color : COLOR_WHITE;
+        user->room = (record.room >= 0 && record.room < MAXROOMS) ? record.room : 0;
+        user->typing_until_ms = 0;
+        user->muted_until_ms = record.muted_until_ms;
+        user->rate_window_start_ms = 0;
+        user->rate_window_msgs = 0;
+        user->busy_notice_ms = 0;
+        user->mute_notice_ms = 0;
+        user->held = NULL;
+        user->held_len = 0;
+        if(record.held_len > 0 && record.held_len <= HANDOFF_HELD_INPUT)
+        {
+            hold_input(user, record.held, record.held_len);
+        }
+        limit_send_buffer(fd);
+        user->out = outbound_create(fd);
+        budget_charge(BUDGET_CONNECTIONS, sizeof(struct user));
+        message_reader_init(&user->reader);
+        if(record.reader_len > 0 && record.reader_len < SESSION_MAX_MESSAGE)
+        {
+            memcpy(user->reader.buf, record.reader_buf, record.reader_len);
+            user->reader.len = record.reader_len;
+        }
+        user->reader.discarding = record.reader_discarding != 0;
+
+        for(int topic = 0; topic < topics->count && topic < 64; ++topic)
+        {
+            if(record.topics & ((uint64_t)1 << topic))
+            {
+                topic_subscribe(topics, topic, user->slot);
+            }
+        }
+
+        userlist[user->slot] = user;
+        num_users++;
     }
+
+    // Wait for the old server to exit so only one process ever reads from the clients
+    while(read(conn, &c, 1) > 0);
+    close(conn);
+
+    return listenfd;
 }
 
-int main()
+// A whole message has arrived from a client
+void handle_client_message(void *ctx, char *msg, int nbytes)
 {
-    fd_set master;
-    fd_set read_fds;
+    struct user *sender = ctx;
+    long long start_ns = 0;
 
-    int fdmax;
+    // A sampled message is traced from when the read that completed it was handed over
+    trace_current = trace_enabled() ? trace_sample() : 0;
+    if(trace_current)
+    {
+        start_ns = trace_now_ns();
+        trace_span(trace_current, "receive", trace_received_ns, start_ns, sender->sockfd);
+    }
 
-    int sockfd;
-    int newfd;
-    struct sockaddr_storage remoteaddr;
-    socklen_t addrlen;
+    // Strip anything that would drive the other users' terminals, and drop messages with nothing left to say
+    nbytes = message_sanitize(msg, nbytes);
+    if(trace_current)
+    {
+        trace_span(trace_current, "sanitize", start_ns, trace_now_ns(), sender->sockfd);
+    }
+
+    if(nbytes != -1 && msg[0] == COMMAND_PREFIX)
+    {
+        handle_client_command(sender->sockfd, msg);
+    }
+    else if(nbytes != -1)
+    {
+        // Sending the message ends their typing
+        set_typing(sender, 0);
+        if(!chat_is_blocked(sender))
+        {
+            send_client_to_clients_msg(sender->sockfd, msg);
+        }
+    }
+    trace_current = 0;
+}
+
+// Handle what was held back for users as if it just came in: chat sent with the end of their login, or during a handoff
+void handle_held_input()
+{
+    struct user *u;
+
+    for(int i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if((u = userlist[i]) != 0 && (u->held != NULL || u->held_len == -1))
+        {
+            // What overflowed, or found no memory, during a handoff that then failed is gone
+            if(u->held_len > 0)
+            {
+                message_reader_feed(&u->reader, u->held, u->held_len, handle_client_message, u);
+            }
+            free_held_input(u);
+            u->held_len = 0;
+        }
+    }
+}
+
+// Route a single event from the loop to whoever handles it
+void handle_event(struct event *ev)
+{
+    struct user *joined;
+    struct user *sender;
+    char input[MAXDATASIZE];
+    int nbytes, index;
+
+    // New client connection
+    if(ev->type == EVENT_ACCEPT)
+    {
+        if(ev->result < 0)
+        {
+            fprintf(stderr, "accept: %s\n", strerror(-ev->result));
+        }
+        else
+        {
+            accept_client(ev->result);
+        }
+    }
+    // Another thread has finished logging a new user in and has passed them through the pipe (NULL if the login failed)
+    else if(ev->type == EVENT_READABLE && ev->fd == pipefd[0])
+    {
+        while(read(pipefd[0], &joined, sizeof joined) == sizeof joined)
+        {
+            pending_logins--;
+            budget_release(BUDGET_LOGINS, LOGIN_THREAD_STACK_SIZE);
+            if(joined != NULL)
+            {
+                register_client(joined);
+            }
+        }
+        // While draining for a handoff it stays held and goes to the replacement
+        if(!handing_off)
+        {
+            handle_held_input();
+        }
+        update_listener();
+    }
+    // Server user is typing. Take everything waiting, as io_uring only reports stdin once per burst of input
+    else if(ev->type == EVENT_READABLE && ev->fd == STDIN_FILENO)
+    {
+        nbytes = read_chars(input, MAXDATASIZE);
+
+        for(int i = 0; i < nbytes; ++i)
+        {
+            handle_terminal_input(input[i]);
+        }
+    }
+    // A replacement server wants our sockets. Finish what is in flight first
+    else if(ev->type == EVENT_READABLE && ev->fd == handoff_sockfd)
+    {
+        if(handoff_conn == -1)
+        {
+            handoff_conn = handoff_accept(handoff_sockfd);
+        }
+    }
+    // The event loop finished sending part of a client's outbound queue
+    else if(ev->type == EVENT_SENT)
+    {
+        outbound_sent(ev->cookie, loop, ev->result);
+    }
+    // Data from a client. Events already reaped for someone removed earlier in the batch (a /kick) are dropped
+    else if(ev->type == EVENT_DATA)
+    {
+        if((index = find_index_of_user_in_userlist_from_fd(ev->fd)) == -1)
+        {
+            event_loop_release(loop, ev);
+            return;
+        }
+
+        // The client has disconnected, or the connection broke
+        if(ev->result <= 0)
+        {
+            if(ev->result < 0)
+            {
+                fprintf(stderr, "recv: %s\n", strerror(-ev->result));
+            }
+            remove_client(ev->fd, NOTICE_LEFT);
+        }
+        else
+        {
+            sender = userlist[index];
+            if(handing_off)
+            {
+                hold_input(sender, ev->data, ev->result);
+            }
+            else
+            {
+                if(trace_enabled())
+                {
+                    trace_received_ns = trace_now_ns();
+                }
+                message_reader_feed(&sender->reader, ev->data, ev->result, handle_client_message, sender);
+            }
+        }
+        event_loop_release(loop, ev);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct event events[EVENT_LOOP_MAX_EVENTS];
+    int nevents;
+    int takeover = 0;
+    long long handling_since_ms;
 
     terminal_buf_len = 0;
     terminal_buf[terminal_buf_len] = '\0';
 
-    char buf[256];
-    int nbytes;
-
     num_users = 0;
 
-    char remoteIP[INET6_ADDRSTRLEN];
-
     int i;
-    char c;
 
-    sockfd = open_server_socket();
+    if(argc == 2 && strcmp(argv[1], "--takeover") == 0)
+    {
+        takeover = 1;
+    }
+    else if(argc != 1)
+    {
+        fprintf(stderr, "usage: server [--takeover]\n");
+        exit(1);
+    }
+
+    initialize_userlist();
+    initialize_topics();
+
+    server_sockfd = takeover ? take_over_from_old_server() : open_server_socket();
+
+    // Without a handoff socket the server still works; it just cannot be replaced in place
+    if(handoff_path(handoff_socket_path, sizeof handoff_socket_path, HANDOFF_NAME) == -1 || (handoff_sockfd = handoff_listen(handoff_socket_path)) == -1)
+    {
+        fprintf(stderr, "server: running without handoff\n");
+    }
 
     if(pipe2(pipefd, O_NONBLOCK) == -1)
     {
         perror("Error: pipe2");
         exit(EXIT_FAILURE);
     }
-    
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
 
-    FD_SET(STDIN_FILENO, &master);
-    FD_SET(sockfd, &master);
-    FD_SET(pipefd[0], &master);
+    if((loop = event_loop_create()) == NULL)
+    {
+        fprintf(stderr, "server: failed to create event loop\n");
+        exit(EXIT_FAILURE);
+    }
+
+    event_loop_add_reader(loop, STDIN_FILENO);
+    event_loop_add_listener(loop, server_sockfd);
+    event_loop_add_reader(loop, pipefd[0]);
+    if(handoff_sockfd != -1)
+    {
+        event_loop_add_reader(loop, handoff_sockfd);
+    }
 
-    fdmax = pipefd[1];
+    for(i = 0; i < MAXCONNECTIONS; ++i)
+    {
+        if(userlist[i] != 0)
+        {
+            event_loop_add_client(loop, userlist[i]->sockfd);
+        }
+    }
 
-    printf("%sStarting server...%s\n", terminal_colors[1], terminal_colors[0]);
+    if(takeover)
+    {
+        handle_held_input();
+        printf("%sTook over %d users from the previous server (%s)...%s\n", SERVER_TERMINAL_COLOR, num_users, event_loop_backend_name(loop), colors[COLOR_RESET].escape);
+    }
+    else
+    {
+        printf("%sStarting server (%s)...%s\n", SERVER_TERMINAL_COLOR, event_loop_backend_name(loop), colors[COLOR_RESET].escape);
+    }
     init_chat();
-    initialize_userlist();
     
     while(1)
     {
-        read_fds = master;
-        if(select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
+        if((nevents = event_loop_wait(loop, events, EVENT_LOOP_MAX_EVENTS, presence_timeout_ms())) == -1)
         {
-            perror("select");
+            perror("event_loop_wait");
             exit(4);
         }
-        for(i = 0; i <= fdmax; ++i)
+        handling_since_ms = now_ms();
+        for(i = 0; i < nevents; ++i)
         {
-            if(FD_ISSET(i, &read_fds))
-            {
-                // New client connection
-                if(i == sockfd) 
-                {
-                    addrlen = sizeof(remoteaddr);
-                    newfd = accept(sockfd, (struct sockaddr*)&remoteaddr, &addrlen);
-
-                    if(newfd == -1)
-                    {
-                        perror("accept");
-                    }
-                    else
-                    {
-                        if(newfd > fdmax)
-                        {
-                            fdmax = newfd;
-                        }
-                        nbytes = sprintf(buf, "New connection from %s\n", inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr*)&remoteaddr), remoteIP, INET6_ADDRSTRLEN));
-                        write_to_term(buf, nbytes);
-
-                        struct thread_info *ti = malloc(sizeof *ti);
-                        ti->client_fd = newfd;
-                        ti->master = &master;
-                        ti->wakeup_pipe_fd = pipefd[1];
-
-                        pthread_t thread;
-                        pthread_create(&thread, NULL, add_client, (void*)ti);
-                    }
-                }
-                // Another thread has finished logging a new user in and has added their socket_fd to the fdset, so reset select()
-                else if(i == pipefd[0])
-                {
-                    for(;;)
-                    {
-                        if(read(pipefd[0], &c, 1) == -1)
-                        {
-                            if(errno == EAGAIN)
-                            {
-                                break;
-                            }
-                        }
-                    }
-                }
-                // Server user is typing
-                else if(i == STDIN_FILENO)
-                {
-                    c = read_char();
+            handle_event(&events[i]);
+        }
 
-                    handle_terminal_input(c);
-                }
-                // Data from a client
-                else
-                {
-                    // The client has disconnected
-                    if((nbytes = recv(i, buf, MAXDATASIZE, 0)) <= 0)
-                    {
-                        if(nbytes == 0)
-                        {
-                            remove_client(i, &master);
-                        }
-                        else
-                        {
-                            perror("recv");
-                        }
-                    }
-                    else
-                    {
-                        send_client_to_clients_msg(i, buf);
-                    }
-                }
+        send_presence_updates();
+        loop_lag_ms = (loop_lag_ms * 7 + now_ms() - handling_since_ms) / 8;
+
+        if(handoff_conn != -1)
+        {
+            // Stop taking new connections, then pick up anything already received before letting go of the clients
+            update_listener();
+            nevents = event_loop_wait(loop, events, EVENT_LOOP_MAX_EVENTS, 0);
+            for(i = 0; i < nevents; ++i)
+            {
+                handle_event(&events[i]);
             }
+
+            hand_off_to_new_server(handoff_conn);
+
+            // The handoff failed before anything was given away
+            handoff_conn = -1;
+            update_listener();
         }
     }
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,449 @@
+/*
+    Server side of the chat protocol, kept apart from any socket I/O.
+*/
+
+#define _GNU_SOURCE
+
+#include "session.h"
+#include "notices.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Convert all characters in string to lower-case for normalization
+static void strToLower(char *buf)
+{
+    for(; *buf != '\0'; ++buf)
+    {
+        *buf = tolower((unsigned char)*buf);
+    }
+}
+
+// Check to see if a clients color request is valid, and if so return the color it names
+int parse_client_color_selection(char* buf)
+{
+    strToLower(buf);
+
+    for(int c = 0; c < COLOR_COUNT; ++c)
+    {
+        if(colors[c].selectable && strcmp(colors[c].name, buf) == 0)
+        {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// Write username in its color, followed by a reset. Returns the bytes written; no terminator is added
+int put_colored_name(char *buf, int color, const char *username)
+{
+    int len = strlen(username);
+    char *p = buf;
+
+    memcpy(p, colors[color].escape, colors[color].escape_nbytes);
+    p += colors[color].escape_nbytes;
+    memcpy(p, username, len);
+    p += len;
+    memcpy(p, colors[COLOR_RESET].escape, colors[COLOR_RESET].escape_nbytes);
+    p += colors[COLOR_RESET].escape_nbytes;
+    return p - buf;
+}
+
+// Assemble a join, leave or kick notice about a user into buf. Returns its length; no terminator is added
+int format_user_notice(char *buf, enum user_notice notice, int color, const char *username)
+{
+    int nbytes = put_colored_name(buf, color, username);
+
+    memcpy(buf + nbytes, user_notices[notice].text, user_notices[notice].nbytes);
+    return nbytes + user_notices[notice].nbytes;
+}
+
+// Which client command buf starts with, CMD_UNKNOWN if none
+enum client_command client_command_lookup(const char *buf)
+{
+    for(int op = 0; op < CMD_UNKNOWN; ++op)
+    {
+        int len = client_commands[op].nbytes;
+
+        if(strncmp(buf, client_commands[op].text, len) == 0 && (buf[len] == '\0' || isspace((unsigned char)buf[len])))
+        {
+            return op;
+        }
+    }
+    return CMD_UNKNOWN;
+}
+
+// The color prompt is the longest reply, and grows with the color table. Fail the build if it could overflow out
+typedef char color_prompt_fits[sizeof color_request_prefix + MAX_USERNAME_LENGTH + sizeof color_request_suffix <= SESSION_OUT_SIZE ? 1 : -1];
+
+// Queue a reply for the client. Handshake messages are NUL-terminated, so nbytes includes the terminator
+static void login_reply(struct login *l, const char *msg, int nbytes)
+{
+    memcpy(l->out + l->out_len, msg, nbytes);
+    l->out_len += nbytes;
+}
+
+// Tell the client there is room for them. Connections that would not fit are refused before a login starts
+void login_start(struct login *l)
+{
+    memset(l, 0, sizeof *l);
+    l->text_color = -1;
+
+    login_reply(l, "0", 2);
+    l->state = LOGIN_AWAIT_SPACE_ACK;
+}
+
+// A whole answer has arrived, so move the handshake along
+static void login_answer(struct login *l, char *answer)
+{
+    int len;
+
+    switch(l->state)
+    {
+        case LOGIN_AWAIT_SPACE_ACK:
+            login_reply(l, name_request_msg, name_request_msg_nbytes);
+            l->state = LOGIN_AWAIT_USERNAME;
+            break;
+
+        case LOGIN_AWAIT_USERNAME:
+            // Names are shown to everyone, so they get the same cleaning as chat. Ones too long to hold are cut short
+            // at a character boundary. One with nothing left to show, or that would read as two in a presence
+            // frame, ends the login
+            if((len = message_sanitize(answer, strlen(answer))) > MAX_USERNAME_LENGTH - 1)
+            {
+                len = MAX_USERNAME_LENGTH - 1;
+                while(len > 0 && ((unsigned char)answer[len] & 0xC0) == 0x80)
+                {
+                    len--;
+                }
+                answer[len] = '\0';
+                len = message_sanitize(answer, len);
+            }
+            if(len == -1 || strpbrk(answer, PRESENCE_NAME_SEPARATOR) != NULL)
+            {
+                login_reply(l, INVALID_USERNAME_NOTICE, sizeof INVALID_USERNAME_NOTICE);
+                l->state = LOGIN_FAILED;
+                break;
+            }
+            memcpy(l->username, answer, len + 1);
+            login_reply(l, color_request_prefix, sizeof color_request_prefix - 1);
+            login_reply(l, l->username, len);
+            login_reply(l, color_request_suffix, sizeof color_request_suffix);
+            l->state = LOGIN_AWAIT_COLOR;
+            break;
+
+        case LOGIN_AWAIT_COLOR:
+            if((l->text_color = parse_client_color_selection(answer)) == -1)
+            {
+                login_reply(l, "0", 2);
+                login_reply(l, retry_color_dialog, sizeof retry_color_dialog);
+            }
+            else
+            {
+                login_reply(l, "1", 2);
+                l->state = LOGIN_AWAIT_JOIN_ACK;
+            }
+            break;
+
+        case LOGIN_AWAIT_JOIN_ACK:
+            login_reply(l, server_join_msg, server_join_msg_nbytes);
+            l->state = LOGIN_DONE;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+    Feed bytes from the client into the handshake, leaving the replies to them in l->out.
+    Returns how many bytes were used. Feeding stops after each complete answer, so the caller sends l->out and feeds
+    the rest again. Once the login is done nothing more is used; whatever is left over is already chat, for the
+    message reader.
+*/
+int login_feed(struct login *l, const char *data, int nbytes)
+{
+    int used = 0;
+
+    l->out_len = 0;
+
+    while(used < nbytes && l->out_len == 0 && l->state != LOGIN_DONE && l->state != LOGIN_FAILED)
+    {
+        if(data[used] != '\0')
+        {
+            // An answer with no end in sight
+            if(l->token_len == SESSION_MAX_TOKEN - 1)
+            {
+                l->state = LOGIN_FAILED;
+                break;
+            }
+            l->token[l->token_len++] = data[used++];
+            continue;
+        }
+
+        used++;
+        l->token[l->token_len] = '\0';
+        l->token_len = 0;
+        login_answer(l, l->token);
+    }
+
+    return used;
+}
+
+void message_reader_init(struct message_reader *r)
+{
+    r->len = 0;
+    r->discarding = 0;
+}
+
+/*
+    Feed bytes from a logged-in client, calling on_message with each complete message (terminator not counted).
+    Partial messages are kept for the next call. A message too long for the buffer is dropped whole.
+    Returns how many messages were delivered.
+*/
+int message_reader_feed(struct message_reader *r, const char *data, int nbytes, message_cb on_message, void *ctx)
+{
+    const char *end = data + nbytes;
+    const char *nul;
+    int chunk, delivered = 0;
+
+    while(data < end)
+    {
+        nul = memchr(data, '\0', end - data);
+        chunk = (nul != NULL ? nul : end) - data;
+
+        if(!r->discarding && r->len + chunk >= SESSION_MAX_MESSAGE)
+        {
+            r->discarding = 1;
+            r->len = 0;
+        }
+        if(!r->discarding)
+        {
+            memcpy(r->buf + r->len, data, chunk);
+            r->len += chunk;
+        }
+
+        if(nul == NULL)
+        {
+            break;
+        }
+
+        if(!r->discarding)
+        {
+            r->buf[r->len] = '\0';
+            on_message(ctx, r->buf, r->len);
+            delivered++;
+        }
+        r->len = 0;
+        r->discarding = 0;
+        data = nul + 1;
+    }
+
+    return delivered;
+}
+
+// Skip over a terminal escape sequence starting at the ESC at p. Returns where the text after it resumes
+static const unsigned char *skip_escape(const unsigned char *p, const unsigned char *end)
+{
+    if(++p == end)
+    {
+        return p;
+    }
+
+    // CSI: parameters and intermediates, then one final byte, e.g. ESC [ 2 J
+    if(*p == '[')
+    {
+        p++;
+        while(p < end && *p >= 0x20 && *p <= 0x3F)
+        {
+            p++;
+        }
+        if(p < end && *p >= 0x40 && *p <= 0x7E)
+        {
+            p++;
+        }
+        return p;
+    }
+
+    // OSC, DCS and the other string sequences run to BEL or ST (ESC \), e.g. ESC ] 0 ; title BEL
+    if(*p == ']' || *p == 'P' || *p == 'X' || *p == '^' || *p == '_')
+    {
+        p++;
+        while(p < end && *p != 0x07 && *p != 0x1B)
+        {
+            p++;
+        }
+        if(p < end && *p == 0x07)
+        {
+            p++;
+        }
+        else if(end - p >= 2 && p[1] == '\\')
+        {
+            p += 2;
+        }
+        return p;
+    }
+
+    // Everything else is intermediates then a final byte, e.g. ESC c or ESC ( 0
+    while(p < end && *p >= 0x20 && *p <= 0x2F)
+    {
+        p++;
+    }
+    if(p < end && *p >= 0x30 && *p <= 0x7E)
+    {
+        p++;
+    }
+    return p;
+}
+
+// Decode one UTF-8 sequence. Returns its length, or 0 if it is malformed, overlong, a surrogate or out of range
+static int utf8_decode(const unsigned char *p, const unsigned char *end, unsigned *cp)
+{
+    unsigned min;
+    int len;
+
+    if(*p >= 0xC2 && *p <= 0xDF)
+    {
+        len = 2;
+        min = 0x80;
+        *cp = *p & 0x1F;
+    }
+    else if(*p >= 0xE0 && *p <= 0xEF)
+    {
+        len = 3;
+        min = 0x800;
+        *cp = *p & 0x0F;
+    }
+    else if(*p >= 0xF0 && *p <= 0xF4)
+    {
+        len = 4;
+        min = 0x10000;
+        *cp = *p & 0x07;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if(end - p < len)
+    {
+        return 0;
+    }
+    for(int i = 1; i < len; ++i)
+    {
+        if((p[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+        *cp = (*cp << 6) | (p[i] & 0x3F);
+    }
+
+    if(*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF))
+    {
+        return 0;
+    }
+    return len;
+}
+
+// Code points that steer the terminal rather than print: C1 controls (0x9B is CSI) and bidi overrides, which can make
+// text read differently from what was sent
+static int is_unicode_control(unsigned cp)
+{
+    return (cp >= 0x80 && cp <= 0x9F) || (cp >= 0x202A && cp <= 0x202E) || (cp >= 0x2066 && cp <= 0x2069);
+}
+
+static int is_unicode_space(unsigned cp)
+{
+    return cp == 0xA0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200B) || cp == 0x2028 || cp == 0x2029 ||
+           cp == 0x202F || cp == 0x205F || cp == 0x3000 || cp == 0xFEFF;
+}
+
+/*
+    Make a message from a client safe to show on other terminals, in place and in a single pass:
+    - escape sequences and other control characters are removed, tabs become spaces
+    - malformed UTF-8 becomes '?', one per bad byte
+    Runs of printable ASCII, which is nearly all chat, are checked and copied 16 bytes at a time where SSE2 is
+    available. msg is left NUL-terminated. Returns the new length, or -1 if nothing but whitespace is left.
+*/
+int message_sanitize(char *msg, int nbytes)
+{
+    const unsigned char *in = (const unsigned char*)msg;
+    const unsigned char *end = in + nbytes;
+    unsigned char *out = (unsigned char*)msg;
+    int has_content = 0;
+    unsigned cp;
+    int len;
+
+    while(in < end)
+    {
+#ifdef __SSE2__
+        // Output never runs ahead of input, so storing a block can only overwrite bytes already read
+        while(end - in >= 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)in);
+            __m128i unprintable = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+
+            // Signed compare, so bytes 0x80 and up count as unprintable too and take the UTF-8 path below
+            if(_mm_movemask_epi8(unprintable) != 0)
+            {
+                break;
+            }
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))) != 0xFFFF)
+            {
+                has_content = 1;
+            }
+            _mm_storeu_si128((__m128i*)out, v);
+            in += 16;
+            out += 16;
+        }
+        if(in == end)
+        {
+            break;
+        }
+#endif
+
+        if(*in >= 0x20 && *in < 0x7F)
+        {
+            has_content |= *in != ' ';
+            *out++ = *in++;
+        }
+        else if(*in == 0x1B)
+        {
+            in = skip_escape(in, end);
+        }
+        else if(*in == '\t')
+        {
+            *out++ = ' ';
+            in++;
+        }
+        else if(*in < 0x80)
+        {
+            in++;
+        }
+        else if((len = utf8_decode(in, end, &cp)) == 0)
+        {
+            *out++ = '?';
+            in++;
+            has_content = 1;
+        }
+        else if(is_unicode_control(cp))
+        {
+            in += len;
+        }
+        else
+        {
+            has_content |= !is_unicode_space(cp);
+            memmove(out, in, len);
+            out += len;
+            in += len;
+        }
+    }
+
+    *out = '\0';
+    return has_content ? (int)(out - (unsigned char*)msg) : -1;
+}
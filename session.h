@@ -0,0 +1,64 @@
+/*
+    Server side of the chat protocol, kept apart from any socket I/O.
+    Bytes from a client are fed in as they arrive, however the network split them, and whatever the server has to say
+    back is left in a buffer for the caller to send. This lets the replay tool drive the exact same code as the server.
+*/
+
+#pragma once
+
+#include "notices.h"
+#include "protocol.h"
+
+#define MAX_USERNAME_LENGTH 20
+#define COLORED_NAME_MAX (MAX_USERNAME_LENGTH + 2 * COLOR_MAX_ESCAPE) // Most put_colored_name() writes
+#define SESSION_MAX_TOKEN 256 // Longest login answer accepted, terminator included
+#define SESSION_MAX_MESSAGE 512 // Longest chat message accepted, terminator included
+#define SESSION_OUT_SIZE 1024
+
+enum login_state
+{
+    LOGIN_AWAIT_SPACE_ACK, // Told the client there is room, waiting for it to carry on
+    LOGIN_AWAIT_USERNAME,
+    LOGIN_AWAIT_COLOR,     // Also while re-asking after an unrecognized color
+    LOGIN_AWAIT_JOIN_ACK,  // Color accepted, waiting for the client before saying it has joined
+    LOGIN_DONE,
+    LOGIN_FAILED
+};
+
+// One client's way through the login handshake. Every message either way is NUL-terminated
+struct login
+{
+    enum login_state state;
+    char username[MAX_USERNAME_LENGTH];
+    int text_color;
+
+    // Partial answer waiting for its terminator
+    char token[SESSION_MAX_TOKEN];
+    int token_len;
+
+    // What the server has to send back after the last call
+    char out[SESSION_OUT_SIZE];
+    int out_len;
+};
+
+// Splits chat from a logged-in client into NUL-terminated messages
+struct message_reader
+{
+    char buf[SESSION_MAX_MESSAGE];
+    int len;
+    int discarding; // The current message outgrew buf and is skipped up to its terminator
+};
+
+typedef void (*message_cb)(void *ctx, char *msg, int nbytes);
+
+void login_start(struct login *l);
+int login_feed(struct login *l, const char *data, int nbytes);
+
+void message_reader_init(struct message_reader *r);
+int message_reader_feed(struct message_reader *r, const char *data, int nbytes, message_cb on_message, void *ctx);
+
+int message_sanitize(char *msg, int nbytes);
+int parse_client_color_selection(char *buf);
+int put_colored_name(char *buf, int color, const char *username);
+int format_user_notice(char *buf, enum user_notice notice, int color, const char *username);
+enum client_command client_command_lookup(const char *buf);
@@ -7,20 +7,10 @@
 #include <string.h>
 
 #define MAXDATASIZE 512
+#define FRAME_BUF_SIZE 8192 // Output held for one frame; past this the oldest lines are dropped
 
 struct termios tp, save;
 
-char *terminal_colors[] = {
-    "\x1B[0m",  // RESET
-    "\x1B[31m", // RED
-    "\x1B[32m", // GREEN
-    "\x1B[33m", // YELLOW
-    "\x1B[34m", // BLUE
-    "\x1B[35m", // MAGENTA
-    "\x1B[36m", // CYAN
-    "\x1B[37m",  // WHITE
-};
-
 char temp_char_buf[1];
 char chat_buf[MAXDATASIZE];
 int chat_buf_len;
@@ -31,6 +21,15 @@ static const int clear_line_nbytes = 5;
 static const char input_line_starter_symbol[] = "> ";
 static const int input_line_starter_symbol_nbytes = sizeof(input_line_starter_symbol);
 
+// Lines waiting for the next frame, and how many were thrown away because they arrived faster than they could be drawn
+char frame_buf[FRAME_BUF_SIZE];
+int frame_buf_len;
+int frame_lines_skipped;
+int frame_needs_redraw;
+
+// Shown in brackets ahead of the input line, e.g. who is typing
+char term_status[MAXDATASIZE];
+
 // Return terminal settings back to normal
 void reset_input_mode()
 {
@@ -103,4 +102,103 @@ void write_int_to_term(int i)
     sprintf(buf, "%d\n", i);
     write_to_term(buf, strlen(buf));
     free(buf);
-}
\ No newline at end of file
+}
+
+// Drain whatever the user has typed so far, up to max characters
+int read_chars(char *buf, int max)
+{
+    int nbytes = read(STDIN_FILENO, buf, max);
+    return nbytes < 0 ? 0 : nbytes;
+}
+
+// Drop whole lines from the front of the frame until at least nbytes are free
+static void make_room_in_frame(int nbytes)
+{
+    char *cut = frame_buf;
+    char *end = frame_buf + frame_buf_len;
+    char *nl;
+
+    while(end - cut > FRAME_BUF_SIZE - nbytes)
+    {
+        nl = memchr(cut, '\n', end - cut);
+        cut = nl ? nl + 1 : end;
+        frame_lines_skipped++;
+    }
+
+    frame_buf_len = end - cut;
+    memmove(frame_buf, cut, frame_buf_len);
+}
+
+// Hold output for the next flush_term() rather than drawing it right away
+void queue_to_term(char *msg, int nbytes)
+{
+    if(nbytes > FRAME_BUF_SIZE)
+    {
+        msg += nbytes - FRAME_BUF_SIZE;
+        nbytes = FRAME_BUF_SIZE;
+    }
+    if(frame_buf_len + nbytes > FRAME_BUF_SIZE)
+    {
+        make_room_in_frame(nbytes);
+    }
+
+    memcpy(frame_buf + frame_buf_len, msg, nbytes);
+    frame_buf_len += nbytes;
+}
+
+int term_has_queued_output()
+{
+    return frame_buf_len > 0 || frame_lines_skipped > 0 || frame_needs_redraw;
+}
+
+// Change the status shown ahead of the input line. It is redrawn with the next frame
+void set_term_status(const char *status)
+{
+    snprintf(term_status, sizeof term_status, "%s", status);
+    frame_needs_redraw = 1;
+}
+
+// Draw everything queued since the last frame and redraw the input line beneath it, all in a single write()
+void flush_term(char *input_line, int input_nbytes)
+{
+    char out[FRAME_BUF_SIZE + 2*MAXDATASIZE + 128];
+    int len = 0;
+
+    if(!term_has_queued_output())
+    {
+        return;
+    }
+
+    memcpy(out + len, clear_line, clear_line_nbytes);
+    len += clear_line_nbytes;
+
+    if(frame_lines_skipped > 0)
+    {
+        len += sprintf(out + len, "[%d messages skipped]\n", frame_lines_skipped);
+        frame_lines_skipped = 0;
+    }
+
+    memcpy(out + len, frame_buf, frame_buf_len);
+    len += frame_buf_len;
+    frame_buf_len = 0;
+
+    frame_needs_redraw = 0;
+
+    memcpy(out + len, clear_line, clear_line_nbytes);
+    len += clear_line_nbytes;
+    if(term_status[0] != '\0')
+    {
+        len += sprintf(out + len, "[%s] ", term_status);
+    }
+    memcpy(out + len, input_line_starter_symbol, input_line_starter_symbol_nbytes);
+    len += input_line_starter_symbol_nbytes;
+
+    if(input_nbytes > MAXDATASIZE)
+    {
+        input_nbytes = MAXDATASIZE;
+    }
+    memcpy(out + len, input_line, input_nbytes);
+    len += input_nbytes;
+
+    write(STDOUT_FILENO, out, len);
+}
@@ -5,13 +5,15 @@
 
 #pragma once
 
-// ANSI color codes
-extern char *terminal_colors[];
-
 void init_chat();
 char read_char();
 void write_to_term(char *msg, int nbytes);
 void write_char_to_input_line(char c);
 void write_backspace_to_input_line();
 void write_int_to_term(int i);
-void clear_input_line();
\ No newline at end of file
+void clear_input_line();
+int read_chars(char *buf, int max);
+void queue_to_term(char *msg, int nbytes);
+int term_has_queued_output();
+void set_term_status(const char *status);
+void flush_term(char *input_line, int input_nbytes);
@@ -0,0 +1,130 @@
+/*
+    Publish/subscribe topics for the server.
+*/
+
+#include "topic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_WORD(slot) ((slot) / 64)
+#define SLOT_BIT(slot) ((uint64_t)1 << ((slot) % 64))
+
+struct topics *topics_create(int nslots)
+{
+    struct topics *t = calloc(1, sizeof *t);
+
+    t->nslots = nslots;
+    t->nwords = (nslots + 63) / 64;
+    return t;
+}
+
+void topics_destroy(struct topics *t)
+{
+    for(int i = 0; i < t->count; ++i)
+    {
+        free(t->list[i].members);
+    }
+    free(t->list);
+    free(t);
+}
+
+// Create a topic with no subscribers, or find it if it already exists. Returns its id
+int topic_add(struct topics *t, const char *name)
+{
+    struct topic *topic;
+    int id = topic_find(t, name);
+
+    if(id != -1)
+    {
+        return id;
+    }
+
+    if(t->count == t->cap)
+    {
+        t->cap = t->cap ? t->cap * 2 : 16;
+        t->list = realloc(t->list, t->cap * sizeof(struct topic));
+    }
+
+    topic = &t->list[t->count];
+    snprintf(topic->name, sizeof topic->name, "%s", name);
+    topic->members = calloc(t->nwords, sizeof(uint64_t));
+    return t->count++;
+}
+
+// Returns the topic's id, or -1 if there is no such topic
+int topic_find(struct topics *t, const char *name)
+{
+    for(int i = 0; i < t->count; ++i)
+    {
+        if(strcmp(t->list[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *topic_name(struct topics *t, int topic)
+{
+    return t->list[topic].name;
+}
+
+void topic_subscribe(struct topics *t, int topic, int slot)
+{
+    t->list[topic].members[SLOT_WORD(slot)] |= SLOT_BIT(slot);
+}
+
+void topic_unsubscribe(struct topics *t, int topic, int slot)
+{
+    t->list[topic].members[SLOT_WORD(slot)] &= ~SLOT_BIT(slot);
+}
+
+int topic_is_subscribed(struct topics *t, int topic, int slot)
+{
+    return (t->list[topic].members[SLOT_WORD(slot)] & SLOT_BIT(slot)) != 0;
+}
+
+// The connection in slot is gone, so drop it from every topic before the slot is reused
+void topics_unsubscribe_all(struct topics *t, int slot)
+{
+    for(int i = 0; i < t->count; ++i)
+    {
+        topic_unsubscribe(t, i, slot);
+    }
+}
+
+int topic_subscriber_count(struct topics *t, int topic)
+{
+    uint64_t *members = t->list[topic].members;
+    int count = 0;
+
+    for(int w = 0; w < t->nwords; ++w)
+    {
+        count += __builtin_popcountll(members[w]);
+    }
+    return count;
+}
+
+/*
+    Fill slots with the topic's subscribers in slot order, up to max_slots of them. Returns how many were filled in.
+    Each word is checked whole, so a sparse topic costs one compare per 64 slots, and set bits are peeled off with
+    count-trailing-zeros rather than testing every slot.
+*/
+int topic_subscribers(struct topics *t, int topic, int *slots, int max_slots)
+{
+    uint64_t *members = t->list[topic].members;
+    uint64_t word;
+    int n = 0;
+
+    for(int w = 0; w < t->nwords; ++w)
+    {
+        word = members[w];
+        while(word != 0 && n < max_slots)
+        {
+            slots[n++] = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,41 @@
+/*
+    Publish/subscribe topics for the server.
+    Each topic keeps its subscribers as a bitset over connection slots, one bit per slot, so subscribing is a bit
+    flip and fanning a message out is a scan over 64-bit words that skips empty stretches 64 slots at a time.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define TOPIC_MAX_NAME 32
+
+struct topic
+{
+    char name[TOPIC_MAX_NAME];
+    uint64_t *members; // One bit per connection slot
+};
+
+struct topics
+{
+    struct topic *list;
+    int count;
+    int cap;
+    int nslots;
+    int nwords; // 64-bit words in each members bitset
+};
+
+struct topics *topics_create(int nslots);
+void topics_destroy(struct topics *t);
+
+int topic_add(struct topics *t, const char *name);
+int topic_find(struct topics *t, const char *name);
+const char *topic_name(struct topics *t, int topic);
+
+void topic_subscribe(struct topics *t, int topic, int slot);
+void topic_unsubscribe(struct topics *t, int topic, int slot);
+int topic_is_subscribed(struct topics *t, int topic, int slot);
+void topics_unsubscribe_all(struct topics *t, int slot);
+
+int topic_subscriber_count(struct topics *t, int topic);
+int topic_subscribers(struct topics *t, int topic, int *slots, int max_slots);
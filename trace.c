@@ -0,0 +1,136 @@
+/*
+    Sampled latency tracing for chat messages.
+*/
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include <stdio.h>
+#include <time.h>
+
+struct trace_span
+{
+    uint64_t seq;      // Index written plus one, 0 while being written
+    const char *stage; // Always a string literal
+    uint32_t id;
+    int fd;            // Recipient for flush spans, sender otherwise, -1 for none
+    long long start_ns;
+    long long dur_ns;
+};
+
+int trace_every;
+
+static struct trace_span ring[TRACE_RING_SIZE];
+static uint64_t head;
+static unsigned long sample_count;
+static uint32_t next_id;
+
+void trace_set_sampling(int every)
+{
+    trace_every = every;
+    sample_count = 0;
+}
+
+// Returns an id for the next message if it is to be traced, 0 if not. Only call while tracing is on
+uint32_t trace_sample()
+{
+    if(sample_count++ % trace_every != 0)
+    {
+        return 0;
+    }
+
+    // 0 means untraced, so skip it when the ids wrap
+    if(++next_id == 0)
+    {
+        next_id = 1;
+    }
+    return next_id;
+}
+
+long long trace_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    Record one stage of a traced message. Writers claim a slot with a single atomic add and publish it by storing its
+    sequence number last, so a reader can tell a finished span from one still being written or already overwritten.
+*/
+void trace_span(uint32_t id, const char *stage, long long start_ns, long long end_ns, int fd)
+{
+    uint64_t n = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    struct trace_span *s = &ring[n & (TRACE_RING_SIZE - 1)];
+
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->stage = stage;
+    s->id = id;
+    s->fd = fd;
+    s->start_ns = start_ns;
+    s->dur_ns = end_ns - start_ns;
+    __atomic_store_n(&s->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long trace_recorded()
+{
+    return __atomic_load_n(&head, __ATOMIC_RELAXED);
+}
+
+/*
+    Write the spans still in the ring to path as Chrome trace event JSON. Each traced message gets its own track,
+    named after its id, with its stages laid out along it. Returns the number of events written, or -1 on error.
+*/
+int trace_dump(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint64_t n = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    uint32_t last_id = 0;
+    struct trace_span s;
+    int written = 0;
+
+    if(f == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for(; n < end; ++n)
+    {
+        struct trace_span *slot = &ring[n & (TRACE_RING_SIZE - 1)];
+
+        // Skip spans a writer is in the middle of replacing
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+        {
+            continue;
+        }
+        s = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != n + 1)
+        {
+            continue;
+        }
+
+        // Name the track of each message as it comes up. A message's flush spans land later, between other messages'
+        // spans, so a track may be named more than once, which viewers accept
+        if(s.id != last_id)
+        {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"message %u\"}}",
+                    written ? ",\n" : "", s.id, s.id);
+            last_id = s.id;
+            written++;
+        }
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"fd\":%d}}",
+                s.stage, s.id, s.start_ns / 1000.0, s.dur_ns / 1000.0, s.fd);
+        written++;
+    }
+    fprintf(f, "\n]}\n");
+
+    if(fclose(f) != 0)
+    {
+        return -1;
+    }
+    return written;
+}
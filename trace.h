@@ -0,0 +1,26 @@
+/*
+    Sampled latency tracing for chat messages.
+    One message in every so many is given an id, and the time it spends in each stage on its way through the server
+    (receive, sanitize, format, lock wait, enqueue, and flush to each recipient) is recorded against a monotonic clock.
+    Spans go into a fixed ring that any thread can write without locking, overwriting the oldest, and can be dumped
+    as Chrome trace event JSON, which Perfetto and chrome://tracing both load. With tracing off the cost is one test
+    of trace_every per message.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define TRACE_RING_SIZE 16384 // Spans kept, a power of two
+#define TRACE_DEFAULT_FILE "chatroom-trace.json"
+
+extern int trace_every; // Sample one message in this many; 0 when tracing is off
+
+#define trace_enabled() (trace_every != 0)
+
+void trace_set_sampling(int every);
+uint32_t trace_sample();
+long long trace_now_ns();
+void trace_span(uint32_t id, const char *stage, long long start_ns, long long end_ns, int fd);
+unsigned long trace_recorded();
+int trace_dump(const char *path);